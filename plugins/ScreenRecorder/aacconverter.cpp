@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "aacconverter.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+}
+
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+static constexpr int kBitrate = 128000;
+// An AAC frame carries at most 6144 bits per channel
+static constexpr uint32_t kMaxPacketBytesPerChannel = 768;
+// Packets the mux may hold on to before they come back
+static constexpr uint32_t kPoolSize = 16;
+
+static constexpr float kScaleS16 = 1.0f / 32768.0f;
+static constexpr float kScaleU8 = 1.0f / 128.0f;
+
+// Mono and stereo get vector loops, the scalar ones handle the remainder
+// and any other channel count. Input may be unaligned.
+void convertS16(const uint8_t *in, int channels, float *const *planes, int offset, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(kScaleS16);
+    if (channels == 1) {
+        for (; i + 8 <= samples; i += 8) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i * 2));
+            const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps(planes[0] + offset + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps(planes[0] + offset + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+    } else if (channels == 2) {
+        // One 32 bit lane per sample, left in the low half
+        for (; i + 4 <= samples; i += 4) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i * 4));
+            const __m128i left = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+            const __m128i right = _mm_srai_epi32(v, 16);
+            _mm_storeu_ps(planes[0] + offset + i, _mm_mul_ps(_mm_cvtepi32_ps(left), scale));
+            _mm_storeu_ps(planes[1] + offset + i, _mm_mul_ps(_mm_cvtepi32_ps(right), scale));
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (channels == 1) {
+        for (; i + 8 <= samples; i += 8) {
+            const int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(in + i * 2));
+            const int32x4_t lo = vmovl_s16(vget_low_s16(v));
+            const int32x4_t hi = vmovl_s16(vget_high_s16(v));
+            vst1q_f32(planes[0] + offset + i, vmulq_n_f32(vcvtq_f32_s32(lo), kScaleS16));
+            vst1q_f32(planes[0] + offset + i + 4, vmulq_n_f32(vcvtq_f32_s32(hi), kScaleS16));
+        }
+    } else if (channels == 2) {
+        for (; i + 4 <= samples; i += 4) {
+            const int32x4_t v = vreinterpretq_s32_u8(vld1q_u8(in + i * 4));
+            const int32x4_t left = vshrq_n_s32(vshlq_n_s32(v, 16), 16);
+            const int32x4_t right = vshrq_n_s32(v, 16);
+            vst1q_f32(planes[0] + offset + i, vmulq_n_f32(vcvtq_f32_s32(left), kScaleS16));
+            vst1q_f32(planes[1] + offset + i, vmulq_n_f32(vcvtq_f32_s32(right), kScaleS16));
+        }
+    }
+#endif
+
+    for (; i < samples; i++) {
+        const uint8_t *sample = in + i * channels * 2;
+        for (int c = 0; c < channels; c++) {
+            const auto value = static_cast<int16_t>(sample[c * 2] | (sample[c * 2 + 1] << 8));
+            planes[c][offset + i] = value * kScaleS16;
+        }
+    }
+}
+
+void convertU8(const uint8_t *in, int channels, float *const *planes, int offset, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(kScaleU8);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    if (channels == 1) {
+        for (; i + 16 <= samples; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+            const __m128i words[2] = { _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias),
+                                       _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias) };
+            for (int w = 0; w < 2; w++) {
+                const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(words[w], words[w]), 16);
+                const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(words[w], words[w]), 16);
+                _mm_storeu_ps(planes[0] + offset + i + w * 8, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                _mm_storeu_ps(planes[0] + offset + i + w * 8 + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+            }
+        }
+    } else if (channels == 2) {
+        for (; i + 8 <= samples; i += 8) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i * 2));
+            const __m128i words[2] = { _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias),
+                                       _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias) };
+            for (int w = 0; w < 2; w++) {
+                const __m128i left = _mm_srai_epi32(_mm_slli_epi32(words[w], 16), 16);
+                const __m128i right = _mm_srai_epi32(words[w], 16);
+                _mm_storeu_ps(planes[0] + offset + i + w * 4, _mm_mul_ps(_mm_cvtepi32_ps(left), scale));
+                _mm_storeu_ps(planes[1] + offset + i + w * 4, _mm_mul_ps(_mm_cvtepi32_ps(right), scale));
+            }
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const int16x8_t bias = vdupq_n_s16(128);
+    if (channels == 1) {
+        for (; i + 16 <= samples; i += 16) {
+            const uint8x16_t v = vld1q_u8(in + i);
+            const int16x8_t words[2] = {
+                vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), bias),
+                vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), bias)
+            };
+            for (int w = 0; w < 2; w++) {
+                const int32x4_t lo = vmovl_s16(vget_low_s16(words[w]));
+                const int32x4_t hi = vmovl_s16(vget_high_s16(words[w]));
+                vst1q_f32(planes[0] + offset + i + w * 8, vmulq_n_f32(vcvtq_f32_s32(lo), kScaleU8));
+                vst1q_f32(planes[0] + offset + i + w * 8 + 4, vmulq_n_f32(vcvtq_f32_s32(hi), kScaleU8));
+            }
+        }
+    } else if (channels == 2) {
+        for (; i + 8 <= samples; i += 8) {
+            const uint8x16_t v = vld1q_u8(in + i * 2);
+            const int16x8_t words[2] = {
+                vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), bias),
+                vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), bias)
+            };
+            for (int w = 0; w < 2; w++) {
+                const int32x4_t pairs = vreinterpretq_s32_s16(words[w]);
+                const int32x4_t left = vshrq_n_s32(vshlq_n_s32(pairs, 16), 16);
+                const int32x4_t right = vshrq_n_s32(pairs, 16);
+                vst1q_f32(planes[0] + offset + i + w * 4, vmulq_n_f32(vcvtq_f32_s32(left), kScaleU8));
+                vst1q_f32(planes[1] + offset + i + w * 4, vmulq_n_f32(vcvtq_f32_s32(right), kScaleU8));
+            }
+        }
+    }
+#endif
+
+    for (; i < samples; i++) {
+        const uint8_t *sample = in + i * channels;
+        for (int c = 0; c < channels; c++)
+            planes[c][offset + i] = (sample[c] - 128) * kScaleU8;
+    }
+}
+} // namespace
+
+AacConverter::AacConverter(int sampleRate, int channels, int sampleSize)
+    : m_channels(channels), m_sampleSize(sampleSize), m_stride(channels * (sampleSize / 8))
+{
+    qDebug() << "Desired sample rate:" << sampleRate;
+
+    if (sampleSize != 8 && sampleSize != 16) {
+        throw std::runtime_error("unsupported PCM sample size");
+    }
+    if (channels < 1 || channels > AV_NUM_DATA_POINTERS) {
+        throw std::runtime_error("unsupported channel count");
+    }
+
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        throw std::runtime_error("no AAC encoder available in libavcodec");
+    }
+
+    m_context = avcodec_alloc_context3(codec);
+    if (!m_context) {
+        throw std::runtime_error("failed to allocate AAC encoder context");
+    }
+
+    m_context->bit_rate = kBitrate;
+    m_context->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    m_context->sample_rate = sampleRate;
+    av_channel_layout_default(&m_context->ch_layout, channels);
+    m_context->time_base = AVRational{ 1, sampleRate };
+    // The decoder specific info goes into the sample description
+    m_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    const int ret = avcodec_open2(m_context, codec, nullptr);
+    if (ret < 0) {
+        qCritical() << "Failed to open AAC encoder:" << ret;
+        release();
+        throw std::runtime_error("failed to open AAC encoder");
+    }
+
+    m_frame = av_frame_alloc();
+    m_packet = av_packet_alloc();
+    if (!m_frame || !m_packet) {
+        release();
+        throw std::runtime_error("failed to allocate AAC encoder frame");
+    }
+    m_frame->nb_samples = m_context->frame_size;
+    m_frame->format = m_context->sample_fmt;
+    m_frame->sample_rate = m_context->sample_rate;
+    av_channel_layout_copy(&m_frame->ch_layout, &m_context->ch_layout);
+    if (av_frame_get_buffer(m_frame, 0) < 0) {
+        release();
+        throw std::runtime_error("failed to allocate AAC encoder frame buffer");
+    }
+
+    m_pool = BufferPool::Create(kMaxPacketBytesPerChannel * channels, kPoolSize);
+    m_partial.resize(m_stride);
+}
+
+AacConverter::~AacConverter()
+{
+    release();
+}
+
+void AacConverter::release()
+{
+    if (m_packet) {
+        av_packet_free(&m_packet);
+    }
+    if (m_frame) {
+        av_frame_free(&m_frame);
+    }
+    if (m_context) {
+        avcodec_free_context(&m_context);
+    }
+}
+
+int AacConverter::frameSize() const
+{
+    return m_context->frame_size;
+}
+
+QByteArray AacConverter::decoderSpecificInfo() const
+{
+    return QByteArray(reinterpret_cast<const char *>(m_context->extradata), m_context->extradata_size);
+}
+
+void AacConverter::encode(const uint8_t *data, size_t length, std::vector<Buffer::Ptr> &packets)
+{
+    if (m_flushed) {
+        return;
+    }
+
+    // Reads don't have to end on a sample boundary
+    if (m_partialBytes > 0) {
+        const size_t missing = std::min(m_stride - m_partialBytes, length);
+        std::memcpy(m_partial.data() + m_partialBytes, data, missing);
+        m_partialBytes += missing;
+        data += missing;
+        length -= missing;
+        if (m_partialBytes < m_stride) {
+            return;
+        }
+        append(m_partial.data(), 1, packets);
+        m_partialBytes = 0;
+    }
+
+    const size_t samples = length / m_stride;
+    append(data, samples, packets);
+
+    m_partialBytes = length - samples * m_stride;
+    std::memcpy(m_partial.data(), data + samples * m_stride, m_partialBytes);
+}
+
+void AacConverter::append(const uint8_t *data, size_t samples, std::vector<Buffer::Ptr> &packets)
+{
+    const int frameSize = m_context->frame_size;
+
+    while (samples > 0) {
+        // The encoder may still reference the previous frame
+        if (m_filled == 0 && av_frame_make_writable(m_frame) < 0) {
+            qCritical() << "Failed to make AAC frame writable";
+            return;
+        }
+
+        const int count = static_cast<int>(std::min<size_t>(samples, frameSize - m_filled));
+        auto planes = reinterpret_cast<float *const *>(m_frame->extended_data);
+        if (!data) {
+            for (int c = 0; c < m_channels; c++)
+                std::fill_n(planes[c] + m_filled, count, 0.0f);
+        } else if (m_sampleSize == 16) {
+            convertS16(data, m_channels, planes, m_filled, count);
+        } else {
+            convertU8(data, m_channels, planes, m_filled, count);
+        }
+        m_filled += count;
+        if (data)
+            data += count * m_stride;
+        samples -= count;
+
+        if (m_filled == frameSize) {
+            m_frame->pts = m_pts;
+            m_pts += frameSize;
+            m_filled = 0;
+            encodeFrame(m_frame, packets);
+        }
+    }
+}
+
+void AacConverter::encodeSilence(size_t samples, std::vector<Buffer::Ptr> &packets)
+{
+    if (!m_flushed)
+        append(nullptr, samples, packets);
+}
+
+void AacConverter::flush(std::vector<Buffer::Ptr> &packets)
+{
+    if (m_flushed) {
+        return;
+    }
+
+    // Only the last frame may be short
+    if (m_filled > 0) {
+        m_frame->nb_samples = m_filled;
+        m_frame->pts = m_pts;
+        m_pts += m_filled;
+        m_filled = 0;
+        encodeFrame(m_frame, packets);
+    }
+    encodeFrame(nullptr, packets);
+    m_flushed = true;
+}
+
+void AacConverter::encodeFrame(const AVFrame *frame, std::vector<Buffer::Ptr> &packets)
+{
+    int ret = avcodec_send_frame(m_context, frame);
+    if (ret < 0) {
+        qCritical() << "avcodec_send_frame returned" << ret;
+        return;
+    }
+
+    while ((ret = avcodec_receive_packet(m_context, m_packet)) >= 0) {
+        const auto size = static_cast<uint32_t>(m_packet->size);
+        // Packet timestamps include the encoder delay, the first ones are
+        // negative.
+        const int64_t timestamp = m_packet->pts * 1000000 / m_context->sample_rate;
+
+        auto buffer = m_pool->Acquire(timestamp);
+        if (buffer && size <= buffer->Capacity()) {
+            std::memcpy(buffer->Data(), m_packet->data, size);
+            buffer->SetRange(0, size);
+        } else {
+            buffer = Buffer::Create(m_packet->data, size);
+            buffer->SetTimestamp(timestamp);
+        }
+        packets.push_back(buffer);
+
+        av_packet_unref(m_packet);
+    }
+}
@@ -1,185 +1,83 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
 #ifndef AACCONVERTER_H
 #define AACCONVERTER_H
 
-extern "C" {
-
-#include <libavcodec/avcodec.h>
-
-class AacConverter {
-public:
-AacConverter() : ctx{nullptr}, codec{nullptr} {};
-AacConverter(const int sampleRate, const int channels) {
-    qDebug() << "Desired sample rate:" << sampleRate;
-
-    // Set up audio encoder
-    codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-    if (codec == NULL) {
-        qDebug() << "Failed to find AAC encoder";
-        return;
-    }
-
-    int i = 0;
-    while (true) {
-        if (codec->supported_samplerates[i] == NULL)
-            break;
-        qDebug() << "Supported sample rate:" << codec->supported_samplerates[i];
-        ++i;
-    }
-
-    ctx = avcodec_alloc_context3(codec);
-    if (!ctx) {
-        qDebug() << "Failed to allocate context";
-    }
-    
-    ctx->bit_rate = 128000;
-    ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
-    ctx->sample_rate = sampleRate;
-    ctx->channel_layout = AV_CH_LAYOUT_STEREO;
-    ctx->channels = av_get_channel_layout_nb_channels(ctx->channel_layout);
-    ctx->profile = FF_PROFILE_AAC_MAIN;
-    ctx->time_base = (AVRational){1, sampleRate};
-    ctx->codec_type = AVMEDIA_TYPE_AUDIO;
-    int ret = avcodec_open2(ctx, codec, nullptr);
-    if (ret < 0) {
-        qDebug() << "Failed to open codec:" << ret;
-    }
-};
-~AacConverter() {
-    if (ctx) {
-        avcodec_close(ctx);
-        av_free(ctx);
-        ctx = nullptr;
-    }
-};
-
-unsigned char* encodeWav(const char* data, unsigned int length, unsigned int& bufSize)
+#include <QByteArray>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "buffer.h"
+#include "bufferpool.h"
+#include "non_copyable.h"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// Streaming AAC-LC encoder for the microphone. Incoming PCM is converted
+// straight into the planes of a single encoder frame, which is handed to
+// libavcodec as soon as it holds exactly frame_size samples. Frame, packet
+// and output buffers are reused, so the cost per second of audio stays the
+// same no matter how the input is split up.
+class AacConverter : public NonCopyable
 {
-    frameEncode = av_frame_alloc();
-
-    if (!frameEncode)
-        return nullptr;
-
-    frameEncode->nb_samples = ctx->frame_size;
-    frameEncode->format = ctx->sample_fmt;
-    frameEncode->channel_layout = ctx->channel_layout;
-
-    int rawOffset = 0;
-    int rawDelta = 0;
-    int rawSamplesCount = frameEncode->nb_samples <= length ? frameEncode->nb_samples : length;
-    char* dataPtr = (char*)data;
-    int i, j, k, ret;
-    uint16_t* samples = nullptr;
-    float t, tincr;
-
-    qDebug() << "AAC rawSamplesCount" << rawSamplesCount <<
-                "frameEncode->nb_samples" << frameEncode->nb_samples <<
-                "length" << length;
-
-    /* allocate the data buffers */
-    ret = av_frame_get_buffer(frameEncode, 0);
-    if (ret < 0) {
-        qDebug() << "Could not allocate audio data buffers:" << ret;
-        return nullptr;
-    }
-
-    ret = av_frame_make_writable(frameEncode);
-    if (ret < 0) {
-        qDebug() << "Failed to make frame writable:" << ret;
-        return nullptr;
-    }
-
-    /*samples = (uint8_t*)frameEncode->data[0];
-    if (!samples) {
-        qDebug() << "Couldn't access frame data";
-        return nullptr;
-    }*/
-
-    /*while (rawSamplesCount > 0)
-    {
-        memcpy(samples, &dataPtr[rawOffset], sizeof(uint8_t) * rawSamplesCount);
-        rawOffset += rawSamplesCount;
-        rawDelta = length - rawOffset;
-        rawSamplesCount = rawDelta > frameEncode->nb_samples ? frameEncode->nb_samples : rawDelta;
-    }*/
-    
-     /* encode a single tone sound */
-     t = 0;
-     tincr = 2 * M_PI * 440.0 / ctx->sample_rate;
-     for (i = 0; i < 200; i++) {
-         /* make sure the frame is writable -- makes a copy if the encoder
-          * kept a reference internally */
-         ret = av_frame_make_writable(frameEncode);
-         if (ret < 0)
-             exit(1);
-         samples = (uint16_t*)frameEncode->data[0];
-  
-         for (j = 0; j < ctx->frame_size; j++) {
-             samples[2*j] = (int)(sin(t) * 10000);
-  
-             for (k = 1; k < ctx->ch_layout.nb_channels; k++)
-                 samples[2*j + k] = samples[2*j];
-             t += tincr;
-         }
-         //encode(c, frame, pkt, f);
-         encodeFrame();
-     }
-
-    qDebug() << "2" << samples << frameEncode->data[0] << &dataPtr[rawOffset];
-
-    //encodeFrame();
-
-    qDebug() << "3";
-
-    av_frame_unref(frameEncode);
-
-    bufSize = collectedSamples.size();
-    return collectedSamples.data();
-}
-
-void encodeFrame()
-{
-    qDebug() << Q_FUNC_INFO;
-
-    /* send the frame for encoding */
-    int ret = avcodec_send_frame(ctx, frameEncode);
-    if (ret < 0)
-    {
-        qDebug() << "avcodec_send_frame returned" << ret;
-        return;
-    }
-
-    qDebug() << ret;
-
-    /* read all the available output packets (in general there may be any number of them) */
-    while (ret >= 0)
-    {
-        ret = avcodec_receive_packet(ctx, &packetEncode);
-        if (ret < 0 && ret != AVERROR(EAGAIN))
-            continue;
-
-        if (ret < 0)
-            break;
-
-        uint8_t* data = (uint8_t *)(malloc(sizeof(uint8_t) * packetEncode.size));
-        memcpy(data, packetEncode.data, (size_t)packetEncode.size);
-        const auto size = (unsigned int)(packetEncode.size);
-
-        for (unsigned int i = 0; i < size; i++) {
-            collectedSamples.push_back(data[i]);
-        }
-        free(data);
-    }
-    av_packet_unref(&packetEncode);
-}
+public:
+    // Takes 8 bit unsigned or 16 bit signed little endian PCM, throws
+    // std::runtime_error if the encoder can't be set up.
+    AacConverter(int sampleRate, int channels, int sampleSize);
+    ~AacConverter();
+
+    int frameSize() const;
+    // AudioSpecificConfig for the sample description
+    QByteArray decoderSpecificInfo() const;
+
+    // Interleaved PCM of any length. Completed packets are appended to
+    // packets, timestamped in microseconds from the first sample.
+    void encode(const uint8_t *data, size_t length, std::vector<Buffer::Ptr> &packets);
+    // Inserts silence, to fill a gap in the input
+    void encodeSilence(size_t samples, std::vector<Buffer::Ptr> &packets);
+    // Encodes the remaining samples and drains the encoder, further input
+    // is ignored.
+    void flush(std::vector<Buffer::Ptr> &packets);
 
 private:
-    AVCodecContext *ctx;
-    AVCodec *codec;
-    AVPacket packetEncode;
-    AVFrame* frameEncode;
-    std::vector<uint8_t> collectedSamples;
+    // Silence if data is null
+    void append(const uint8_t *data, size_t samples, std::vector<Buffer::Ptr> &packets);
+    void encodeFrame(const AVFrame *frame, std::vector<Buffer::Ptr> &packets);
+    void release();
+
+    AVCodecContext *m_context = nullptr;
+    AVFrame *m_frame = nullptr;
+    AVPacket *m_packet = nullptr;
+    BufferPool::Ptr m_pool;
+    const int m_channels;
+    const int m_sampleSize;
+    // Bytes per interleaved sample, all channels
+    const size_t m_stride;
+    // Samples already converted into m_frame
+    int m_filled = 0;
+    int64_t m_pts = 0;
+    bool m_flushed = false;
+    // Start of a sample split across two reads
+    std::vector<uint8_t> m_partial;
+    size_t m_partialBytes = 0;
 };
 
-}
-
-#endif
+#endif // AACCONVERTER_H
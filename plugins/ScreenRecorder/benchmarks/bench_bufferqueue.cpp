@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <thread>
+
+#include "../buffer.h"
+#include "../bufferqueue.h"
+#include "../spscbufferqueue.h"
+
+// Hands buffers from a producer thread to the benchmark thread, the time
+// per iteration is the cost of moving one buffer across while both sides
+// hammer on the queue.
+namespace {
+static constexpr uint32_t kCapacity = 16;
+
+class LockedQueue
+{
+public:
+    LockedQueue() : m_queue(nullptr, kCapacity, BufferQueue::OverflowPolicy::Block) {}
+    void push(const Buffer::Ptr &buffer) { m_queue.push(buffer); }
+    Buffer::Ptr next() { return m_queue.next(); }
+
+private:
+    BufferQueue m_queue;
+};
+
+template <SpscBufferQueue::Wakeup W>
+class LockFreeQueue
+{
+public:
+    LockFreeQueue() : m_queue(kCapacity, SpscBufferQueue::OverflowPolicy::Block, W) {}
+    void push(const Buffer::Ptr &buffer) { m_queue.push(buffer); }
+    Buffer::Ptr next() { return m_queue.next(); }
+
+private:
+    SpscBufferQueue m_queue;
+};
+
+template <typename Queue>
+void BM_Contended(benchmark::State &state)
+{
+    Queue queue;
+    const auto buffer = Buffer::Create(nullptr);
+    std::atomic<bool> running{ true };
+
+    std::thread producer([&]() {
+        while (running.load(std::memory_order_relaxed)) {
+            queue.push(buffer);
+        }
+    });
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(queue.next());
+    }
+
+    running.store(false);
+    // Unblock a producer waiting for a free slot
+    while (queue.next()) {
+    }
+    producer.join();
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Producer and consumer take turns, no contention at all
+template <typename Queue>
+void BM_Uncontended(benchmark::State &state)
+{
+    Queue queue;
+    const auto buffer = Buffer::Create(nullptr);
+
+    for (auto _ : state) {
+        queue.push(buffer);
+        benchmark::DoNotOptimize(queue.next());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_Contended, LockedQueue)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Contended, LockFreeQueue<SpscBufferQueue::Wakeup::EventFd>)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Contended, LockFreeQueue<SpscBufferQueue::Wakeup::Poll>)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Uncontended, LockedQueue);
+BENCHMARK_TEMPLATE(BM_Uncontended, LockFreeQueue<SpscBufferQueue::Wakeup::EventFd>);
+BENCHMARK_TEMPLATE(BM_Uncontended, LockFreeQueue<SpscBufferQueue::Wakeup::Poll>);
+
+BENCHMARK_MAIN();
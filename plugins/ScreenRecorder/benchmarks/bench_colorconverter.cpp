@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../colorconverter.h"
+
+namespace {
+std::vector<uint8_t> makeFrame(int width, int height)
+{
+    std::mt19937 rng(width * height);
+    std::vector<uint8_t> frame(static_cast<size_t>(width) * height * 4);
+    for (auto &byte : frame) {
+        byte = static_cast<uint8_t>(rng());
+    }
+    return frame;
+}
+
+// What AvcodecH264Encoder did before the converter, one pixel at a time
+void convertPerPixel(const uint8_t *src, int srcWidth, int srcHeight, int srcStride,
+                     const ColorConverter::Planes &dst, int dstWidth, int dstHeight)
+{
+    for (int y = 0; y < dstHeight; y += 2) {
+        const int sy0 = y * srcHeight / dstHeight;
+        const int sy1 = std::min(y + 1, dstHeight - 1) * srcHeight / dstHeight;
+        const uint8_t *srcRows[2] = { src + sy0 * srcStride, src + sy1 * srcStride };
+        uint8_t *yRows[2] = { dst.data[0] + y * dst.linesize[0],
+                              dst.data[0] + std::min(y + 1, dstHeight - 1) * dst.linesize[0] };
+        uint8_t *uRow = dst.data[1] + (y / 2) * dst.linesize[1];
+        uint8_t *vRow = dst.data[2] + (y / 2) * dst.linesize[2];
+        for (int x = 0; x < dstWidth; x += 2) {
+            int rs = 0, gs = 0, bs = 0;
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    const int sx = std::min(x + dx, dstWidth - 1) * srcWidth / dstWidth;
+                    const uint8_t *p = srcRows[dy] + sx * 4;
+                    const int r = p[0], g = p[1], b = p[2];
+                    yRows[dy][std::min(x + dx, dstWidth - 1)] =
+                            static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                    rs += r;
+                    gs += g;
+                    bs += b;
+                }
+            }
+            rs >>= 2;
+            gs >>= 2;
+            bs >>= 2;
+            uRow[x / 2] = static_cast<uint8_t>(((-38 * rs - 74 * gs + 112 * bs + 128) >> 8) + 128);
+            vRow[x / 2] = static_cast<uint8_t>(((112 * rs - 94 * gs - 18 * bs + 128) >> 8) + 128);
+        }
+    }
+}
+
+// Arguments are the source height and the output scale in percent, the
+// converter also takes the number of threads. Sources are 16:9 RGBA.
+struct Frame
+{
+    explicit Frame(const benchmark::State &state)
+        : srcHeight(state.range(0)),
+          srcWidth(srcHeight * 16 / 9),
+          dstWidth(static_cast<int>(srcWidth * state.range(1) / 100) & ~1),
+          dstHeight(static_cast<int>(srcHeight * state.range(1) / 100) & ~1),
+          src(makeFrame(srcWidth, srcHeight)),
+          dst(static_cast<size_t>(dstWidth) * dstHeight * 3 / 2)
+    {
+        planes.data[0] = dst.data();
+        planes.data[1] = planes.data[0] + dstWidth * dstHeight;
+        planes.data[2] = planes.data[1] + dstWidth * dstHeight / 4;
+        planes.linesize[0] = dstWidth;
+        planes.linesize[1] = dstWidth / 2;
+        planes.linesize[2] = dstWidth / 2;
+    }
+
+    int srcHeight;
+    int srcWidth;
+    int dstWidth;
+    int dstHeight;
+    std::vector<uint8_t> src;
+    std::vector<uint8_t> dst;
+    ColorConverter::Planes planes;
+};
+
+void BM_ColorConverter(benchmark::State &state)
+{
+    Frame frame(state);
+    ColorConverter::Config config;
+    config.srcWidth = frame.srcWidth;
+    config.srcHeight = frame.srcHeight;
+    config.dstWidth = frame.dstWidth;
+    config.dstHeight = frame.dstHeight;
+    config.threads = state.range(2);
+    ColorConverter converter(config);
+
+    for (auto _ : state) {
+        converter.convert(frame.src.data(), frame.planes);
+        benchmark::DoNotOptimize(frame.dst.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_PerPixel(benchmark::State &state)
+{
+    Frame frame(state);
+
+    for (auto _ : state) {
+        convertPerPixel(frame.src.data(), frame.srcWidth, frame.srcHeight, frame.srcWidth * 4,
+                        frame.planes, frame.dstWidth, frame.dstHeight);
+        benchmark::DoNotOptimize(frame.dst.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void ThreadedResolutions(benchmark::internal::Benchmark *benchmark)
+{
+    for (int height : { 720, 1080, 1440 }) {
+        for (int scale : { 100, 50 }) {
+            for (int threads : { 1, 2, 4 }) {
+                benchmark->Args({ height, scale, threads });
+            }
+        }
+    }
+}
+
+void Resolutions(benchmark::internal::Benchmark *benchmark)
+{
+    for (int height : { 720, 1080, 1440 }) {
+        for (int scale : { 100, 50 }) {
+            benchmark->Args({ height, scale });
+        }
+    }
+}
+} // namespace
+
+BENCHMARK(BM_ColorConverter)
+        ->Apply(ThreadedResolutions)
+        ->ArgNames({ "height", "scale", "threads" })
+        ->UseRealTime()
+        ->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_PerPixel)
+        ->Apply(Resolutions)
+        ->ArgNames({ "height", "scale" })
+        ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSharedPointer>
+#include <QTimer>
+#include <atomic>
+#include <ctime>
+
+#include "../captures/synthetic.h"
+#include "../encoders/avcodec_h264.h"
+#include "../muxers/mp4.h"
+#include "../screen_recorder.h"
+
+// Records a synthetic test pattern through the real pipeline: capture,
+// software encoder and mp4 muxer wired up by ScreenRecorder::setup, no
+// display server or hybris needed. Reports throughput and CPU time and
+// fails if nothing made it into the file, so it doubles as a smoke test.
+namespace {
+bool parsePattern(const QString &name, CaptureSynthetic::Pattern &pattern)
+{
+    if (name == QStringLiteral("static"))
+        pattern = CaptureSynthetic::Pattern::Static;
+    else if (name == QStringLiteral("scrolling"))
+        pattern = CaptureSynthetic::Pattern::Scrolling;
+    else if (name == QStringLiteral("noise"))
+        pattern = CaptureSynthetic::Pattern::Noise;
+    else if (name == QStringLiteral("damage"))
+        pattern = CaptureSynthetic::Pattern::PartialDamage;
+    else
+        return false;
+    return true;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless recording pipeline benchmark");
+    parser.addHelpOption();
+    parser.addOptions({
+            { "pattern", "static, scrolling, noise or damage", "pattern", "scrolling" },
+            { "width", "Frame width", "pixels", "1280" },
+            { "height", "Frame height", "pixels", "720" },
+            { "framerate", "Capture rate", "fps", "30" },
+            { "scale", "Encoder output scale", "factor", "1.0" },
+            { "duration", "Length of the recording", "seconds", "5" },
+            { "output", "Recording to write", "file", "/tmp/bench_pipeline.mp4" },
+    });
+    parser.process(app);
+
+    CaptureSynthetic::Config captureConfig;
+    captureConfig.width = parser.value("width").toInt();
+    captureConfig.height = parser.value("height").toInt();
+    captureConfig.framerate = parser.value("framerate").toDouble();
+    if (!parsePattern(parser.value("pattern"), captureConfig.pattern)) {
+        qCritical() << "unknown pattern" << parser.value("pattern");
+        return 2;
+    }
+    const auto duration = parser.value("duration").toDouble();
+    const auto output = parser.value("output");
+
+    QSharedPointer<CaptureSynthetic> capture(new CaptureSynthetic(captureConfig));
+    capture->init();
+
+    auto encoderConfig = AvcodecH264Encoder::defaultConfig();
+    encoderConfig.width = capture->width();
+    encoderConfig.height = capture->height();
+    encoderConfig.output_scale = parser.value("scale").toFloat();
+    encoderConfig.format = capture->pixelFormat();
+    encoderConfig.framerate = static_cast<int>(captureConfig.framerate);
+    QSharedPointer<AvcodecH264Encoder> encoder(new AvcodecH264Encoder());
+    try {
+        encoder->configure(encoderConfig);
+    } catch (const std::runtime_error &e) {
+        qCritical() << "failed to configure encoder:" << e.what();
+        return 1;
+    }
+
+    QSharedPointer<MuxMp4> mux(new MuxMp4());
+    mux->setTiming(MuxMp4::Timing::Variable, encoderConfig.framerate);
+
+    std::atomic<uint64_t> frames{ 0 };
+    QObject::connect(mux.data(), &MuxMp4::frameAppended, [&frames](int64_t) { frames++; });
+
+    ScreenRecorder recorder;
+    recorder.setup(encoder, capture, mux);
+    mux->start(output, capture->width(), capture->height());
+
+    QElapsedTimer wallClock;
+    const auto cpuStart = std::clock();
+    wallClock.start();
+    recorder.start(static_cast<float>(captureConfig.framerate));
+
+    int result = 0;
+    QTimer::singleShot(static_cast<int>(duration * 1000), [&]() {
+        recorder.stop();
+        QMetaObject::invokeMethod(mux.data(), "stop", Qt::BlockingQueuedConnection);
+
+        const auto wall = wallClock.elapsed() / 1000.0;
+        const auto cpu = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        const auto expected = static_cast<uint64_t>(duration * captureConfig.framerate);
+        const auto size = QFileInfo(output).size();
+
+        qInfo().noquote() << QString("%1 %2x%3@%4: %5 of %6 frames muxed in %7 s, %8 fps, "
+                                     "cpu %9 s (%10 ms per frame), %11 KiB")
+                                     .arg(parser.value("pattern"))
+                                     .arg(captureConfig.width)
+                                     .arg(captureConfig.height)
+                                     .arg(captureConfig.framerate)
+                                     .arg(frames.load())
+                                     .arg(expected)
+                                     .arg(wall, 0, 'f', 2)
+                                     .arg(frames.load() / wall, 0, 'f', 1)
+                                     .arg(cpu, 0, 'f', 2)
+                                     .arg(frames.load() ? cpu * 1000.0 / frames.load() : 0.0, 0, 'f', 2)
+                                     .arg(size / 1024);
+
+        if (frames.load() == 0 || size <= 0) {
+            qCritical() << "no frames were recorded";
+            result = 1;
+        }
+        app.exit(result);
+    });
+
+    return app.exec();
+}
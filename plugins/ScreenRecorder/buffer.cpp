@@ -16,6 +16,7 @@
  */
 
 #include <memory.h>
+#include <stdlib.h>
 
 #include "buffer.h"
 
@@ -23,6 +24,8 @@ Buffer::Ptr Buffer::Create(uint32_t capacity, int64_t timestamp)
 {
     auto buffer = std::shared_ptr<Buffer>(new Buffer(timestamp));
     buffer->Allocate(capacity);
+    if (buffer->data_)
+        ::memset(buffer->data_, 0, capacity);
     return buffer;
 }
 
@@ -30,7 +33,8 @@ Buffer::Ptr Buffer::Create(uint8_t *data, uint32_t length)
 {
     auto buffer = std::shared_ptr<Buffer>(new Buffer);
     buffer->Allocate(length);
-    ::memcpy(buffer->data_, data, length);
+    if (buffer->data_)
+        ::memcpy(buffer->data_, data, length);
     return buffer;
 }
 
@@ -87,13 +91,27 @@ void Buffer::SetTimestamp(int64_t timestamp)
     timestamp_ = timestamp;
 }
 
-void Buffer::Allocate(uint32_t capacity)
+void Buffer::Allocate(uint32_t capacity, uint32_t alignment)
 {
     if (data_)
         return;
 
-    data_ = new uint8_t[capacity];
-    ::memset(data_, 0, capacity);
+    // Memory is always released with free() so it has to come from the
+    // malloc family here as well. An empty buffer still gets memory of its
+    // own, like new[] used to hand out, so that it stays valid.
+    const size_t size = capacity > 0 ? capacity : 1;
+    void *data = nullptr;
+    if (alignment > sizeof(void *)) {
+        if (::posix_memalign(&data, alignment, size) != 0)
+            data = nullptr;
+    } else {
+        data = ::malloc(size);
+    }
+
+    if (!data)
+        return;
+
+    data_ = static_cast<uint8_t *>(data);
     capacity_ = capacity;
     length_ = capacity;
     offset_ = 0;
@@ -65,7 +65,7 @@ protected:
     Buffer();
     Buffer(int64_t timestamp);
 
-    void Allocate(uint32_t size);
+    void Allocate(uint32_t size, uint32_t alignment = 0);
 
 private:
     std::weak_ptr<Delegate> delegate_;
@@ -77,6 +77,7 @@ private:
     void *native_handle_;
 
     friend class BufferOutputTarget;
+    friend class BufferPool;
 };
 
 Q_DECLARE_METATYPE(Buffer::Ptr)
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bufferpool.h"
+
+#include <QDebug>
+#include <algorithm>
+
+BufferPool::Ptr BufferPool::Create(uint32_t buffer_size, uint32_t count, uint32_t alignment)
+{
+    auto pool = std::shared_ptr<BufferPool>(new BufferPool(buffer_size, count, alignment));
+
+    std::lock_guard<std::mutex> l(pool->mutex_);
+    for (uint32_t n = 0; n < count; n++) {
+        auto buffer = pool->Allocate();
+        if (!buffer)
+            break;
+        pool->free_.push_back(buffer);
+    }
+
+    return pool;
+}
+
+BufferPool::BufferPool(uint32_t buffer_size, uint32_t count, uint32_t alignment)
+    : buffer_size_(buffer_size), count_(count), alignment_(alignment)
+{
+    free_.reserve(count);
+}
+
+BufferPool::~BufferPool()
+{
+    const auto stats = GetStats();
+    qDebug() << "buffer pool hits" << stats.hits << "misses" << stats.misses;
+}
+
+Buffer::Ptr BufferPool::Allocate()
+{
+    auto buffer = std::shared_ptr<Buffer>(new Buffer);
+    buffer->Allocate(buffer_size_, alignment_);
+    if (!buffer->IsValid())
+        return nullptr;
+
+    // The delegate is only held weakly, buffers still out in the pipeline
+    // when the pool goes away are simply freed once their last user drops
+    // them.
+    buffer->SetDelegate(shared_from_this());
+    return buffer;
+}
+
+Buffer::Ptr BufferPool::Acquire(int64_t timestamp)
+{
+    Buffer::Ptr buffer;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (!free_.empty()) {
+            buffer = std::move(free_.back());
+            free_.pop_back();
+        }
+    }
+
+    if (buffer) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        buffer = Allocate();
+        if (!buffer)
+            return nullptr;
+    }
+
+    buffer->SetRange(0, buffer_size_);
+    buffer->SetTimestamp(timestamp);
+    return buffer;
+}
+
+BufferPool::Stats BufferPool::GetStats()
+{
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> l(mutex_);
+    stats.available = free_.size();
+    return stats;
+}
+
+void BufferPool::OnBufferFinished(const Buffer::Ptr &buffer)
+{
+    if (!buffer || buffer->Capacity() != buffer_size_)
+        return;
+
+    std::lock_guard<std::mutex> l(mutex_);
+    if (std::find(free_.begin(), free_.end(), buffer) != free_.end())
+        return;
+
+    // Buffers allocated on a miss are kept as long as the pool is not back
+    // at its configured size, anything beyond that is freed.
+    if (free_.size() < count_)
+        free_.push_back(buffer);
+}
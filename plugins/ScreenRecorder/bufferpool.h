@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "buffer.h"
+
+// Hands out pre-allocated buffers of a fixed size. Consumers give them back
+// by calling Buffer::Release() once they are done with the data, which
+// routes them through OnBufferFinished() into the free list again instead of
+// freeing the memory.
+class BufferPool : public Buffer::Delegate, public std::enable_shared_from_this<BufferPool>
+{
+public:
+    typedef std::shared_ptr<BufferPool> Ptr;
+
+    struct Stats
+    {
+        // Acquire() calls served from the free list
+        uint64_t hits;
+        // Acquire() calls which had to allocate a new buffer
+        uint64_t misses;
+        // Buffers currently sitting in the free list
+        uint32_t available;
+    };
+
+    static BufferPool::Ptr Create(uint32_t buffer_size, uint32_t count,
+                                  uint32_t alignment = kDefaultAlignment);
+
+    ~BufferPool();
+
+    // Returns a buffer with its range covering the whole capacity. The
+    // content is whatever the previous user left in it.
+    Buffer::Ptr Acquire(int64_t timestamp = 0ll);
+
+    uint32_t BufferSize() const { return buffer_size_; }
+    uint32_t Count() const { return count_; }
+    Stats GetStats();
+
+    void OnBufferFinished(const Buffer::Ptr &buffer) override;
+
+private:
+    static constexpr uint32_t kDefaultAlignment = 64;
+
+    BufferPool(uint32_t buffer_size, uint32_t count, uint32_t alignment);
+
+    Buffer::Ptr Allocate();
+
+    const uint32_t buffer_size_;
+    const uint32_t count_;
+    const uint32_t alignment_;
+    std::mutex mutex_;
+    std::vector<Buffer::Ptr> free_;
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+};
+
+#endif // BUFFER_POOL_H
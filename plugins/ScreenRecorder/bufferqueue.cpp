@@ -17,8 +17,44 @@
 
 #include "bufferqueue.h"
 
-BufferQueue::BufferQueue(QObject *parent, uint32_t max_size) : QObject(parent), m_max_size(max_size)
+#include <algorithm>
+
+BufferQueue::BufferQueue(QObject *parent, uint32_t max_size, OverflowPolicy policy)
+    : QObject(parent), m_max_size(max_size), m_policy(policy)
+{
+}
+
+void BufferQueue::setOverflowPolicy(OverflowPolicy policy,
+                                    const std::chrono::milliseconds &pushTimeout)
+{
+    std::unique_lock<std::mutex> l(m_mutex);
+    m_policy = policy;
+    m_pushTimeout = pushTimeout;
+}
+
+BufferQueue::Stats BufferQueue::stats()
+{
+    std::unique_lock<std::mutex> l(m_mutex);
+    return m_stats;
+}
+
+void BufferQueue::resetStats()
 {
+    std::unique_lock<std::mutex> l(m_mutex);
+    m_stats = Stats();
+}
+
+void BufferQueue::recordPushUnlocked()
+{
+    m_stats.pushes++;
+    m_stats.highWaterMark = std::max<uint32_t>(m_stats.highWaterMark, m_queue.size());
+}
+
+void BufferQueue::dropUnlocked(const Buffer::Ptr &buffer)
+{
+    m_stats.drops++;
+    if (buffer)
+        buffer->Release();
 }
 
 void BufferQueue::lock()
@@ -29,6 +65,7 @@ void BufferQueue::lock()
 void BufferQueue::pushUnlocked(const Buffer::Ptr &buffer)
 {
     m_queue.push(buffer);
+    recordPushUnlocked();
 }
 
 void BufferQueue::unlock()
@@ -48,21 +85,60 @@ Buffer::Ptr BufferQueue::next()
     // Wait 1.5 seconds at max until filled as concurrent use of Aethercast
     // and the screen recorder can cause a deadlock situation as observed
     // on the Pixel 3a.
-    if (!waitToBeFilled(std::chrono::milliseconds{ 1500 }))
-        return nullptr;
+    const auto waitStart = std::chrono::steady_clock::now();
+    const auto filled = waitToBeFilled(std::chrono::milliseconds{ 1500 });
+    const auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - waitStart);
 
     std::unique_lock<std::mutex> l(m_mutex);
+    m_stats.popWait += waited;
+    if (!filled || m_queue.empty())
+        return nullptr;
+
     auto buffer = m_queue.front();
     m_queue.pop();
+    m_lock.notify_one();
     return buffer;
 }
 
 void BufferQueue::push(const Buffer::Ptr &buffer)
 {
     std::unique_lock<std::mutex> l(m_mutex);
-    if (isLimited() && m_queue.size() >= m_max_size)
-        return;
+    if (m_policy == OverflowPolicy::CoalesceLatest) {
+        while (!m_queue.empty()) {
+            dropUnlocked(m_queue.front());
+            m_queue.pop();
+        }
+    } else if (isLimited() && m_queue.size() >= m_max_size) {
+        switch (m_policy) {
+        case OverflowPolicy::Block: {
+            const auto waitStart = std::chrono::steady_clock::now();
+            const auto freed = m_lock.wait_until(l, waitStart + m_pushTimeout, [&]() {
+                return m_queue.size() < m_max_size;
+            });
+            m_stats.pushWait += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - waitStart);
+            if (!freed) {
+                dropUnlocked(buffer);
+                return;
+            }
+            break;
+        }
+        case OverflowPolicy::DropNewest:
+            dropUnlocked(buffer);
+            return;
+        case OverflowPolicy::DropOldest:
+            while (m_queue.size() >= m_max_size) {
+                dropUnlocked(m_queue.front());
+                m_queue.pop();
+            }
+            break;
+        case OverflowPolicy::CoalesceLatest:
+            break;
+        }
+    }
     m_queue.push(buffer);
+    recordPushUnlocked();
     m_lock.notify_one();
 }
 
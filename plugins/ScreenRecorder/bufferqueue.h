@@ -23,6 +23,7 @@
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include <functional>
 
 #include "buffer.h"
@@ -31,7 +32,41 @@ class BufferQueue : public QObject
 {
     Q_OBJECT
 public:
-    BufferQueue(QObject *parent = nullptr, uint32_t max_size = 0);
+    // What push() does when a limited queue is already full. Dropped buffers
+    // are handed back to their producer through Buffer::Release().
+    enum class OverflowPolicy {
+        // Wait for the consumer to free a slot, drop the new buffer if that
+        // doesn't happen within the push timeout.
+        Block,
+        // Discard the incoming buffer.
+        DropNewest,
+        // Discard the stalest queued buffer to make room.
+        DropOldest,
+        // Keep only the newest buffer: every push discards whatever is
+        // still queued, whether the queue is full or not.
+        CoalesceLatest,
+    };
+
+    struct Stats
+    {
+        uint64_t pushes = 0;
+        uint64_t drops = 0;
+        uint32_t highWaterMark = 0;
+        // Time producers spent blocked on a full queue
+        std::chrono::microseconds pushWait{ 0 };
+        // Time consumers spent waiting on an empty queue
+        std::chrono::microseconds popWait{ 0 };
+    };
+
+    BufferQueue(QObject *parent = nullptr, uint32_t max_size = 0,
+                OverflowPolicy policy = OverflowPolicy::DropNewest);
+
+    void setOverflowPolicy(OverflowPolicy policy,
+                           const std::chrono::milliseconds &pushTimeout = std::chrono::milliseconds{ 100 });
+    OverflowPolicy overflowPolicy() const { return m_policy; }
+
+    Stats stats();
+    void resetStats();
 
     Buffer::Ptr next();
     Buffer::Ptr front();
@@ -57,7 +92,13 @@ public:
     bool waitFor(const std::function<bool()> &pred, const std::chrono::milliseconds &timeout);
 
 private:
+    void recordPushUnlocked();
+    void dropUnlocked(const Buffer::Ptr &buffer);
+
     uint32_t m_max_size;
+    OverflowPolicy m_policy;
+    std::chrono::milliseconds m_pushTimeout{ 100 };
+    Stats m_stats;
     std::queue<Buffer::Ptr> m_queue;
     std::mutex m_mutex;
     std::condition_variable m_lock;
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CAPTURES_BUFFERSTREAM_H
+#define CAPTURES_BUFFERSTREAM_H
+
+#include <cstdint>
+#include <functional>
+
+#include "../non_copyable.h"
+
+// CPU view of the current buffer, valid until the next swap
+struct MappedFrame
+{
+    const uint8_t *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+};
+
+// The part of a screencast buffer stream the capture pipeline uses. Mir
+// implements it in the capture, a mock can stand in for it.
+class BufferStream : public NonCopyable
+{
+public:
+    typedef std::function<void()> SwapCallback;
+
+    // Hands the current buffer back to the compositor and has the next one
+    // filled. done runs on an arbitrary thread once that one is current.
+    // Returns false if the swap couldn't be started.
+    virtual bool swapBuffers(const SwapCallback &done) = 0;
+    virtual void *nativeBuffer() = 0;
+    virtual bool map(MappedFrame &frame) = 0;
+};
+
+#endif // CAPTURES_BUFFERSTREAM_H
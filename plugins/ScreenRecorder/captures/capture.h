@@ -19,8 +19,13 @@
 #define CAPTURES_CAPTURE_H
 
 #include <QtPlugin>
+#include <QRect>
 #include <QSharedPointer>
+#include <QSize>
+#include <algorithm>
+#include <utility>
 #include "../buffer.h"
+#include "../mediaclock.h"
 
 class Capture
 {
@@ -28,6 +33,38 @@ public:
     virtual void init() = 0;
     virtual int width() = 0;
     virtual int height() = 0;
+    // Frames are stamped with the media time they were captured at.
+    // Captures with a timeline of their own may ignore it.
+    virtual void setClock(const MediaClock::Ptr &clock) { Q_UNUSED(clock); }
+    // Captures only part of the screen, in the coordinates of the captured
+    // output. A null region captures all of it. Must be set after init()
+    // and before start(), width() and height() report the region snapped
+    // by alignRegion(). Captures with a fixed size may ignore it.
+    virtual void setRegion(const QRect &region) { Q_UNUSED(region); }
+
+    // Clips region to bounds and rounds its size up to whole 16x16
+    // macroblocks, so the encoder neither pads nor crops. The region is
+    // moved back inside bounds where rounding pushed it out, and shrunk
+    // to whole macroblocks if bounds are too small for it.
+    static QRect alignRegion(const QRect &region, const QSize &bounds)
+    {
+        static constexpr int kMacroblockSize = 16;
+        const auto align = [](int start, int length, int bound) {
+            const int maxLength = bound / kMacroblockSize * kMacroblockSize;
+            length = (length + kMacroblockSize - 1) / kMacroblockSize * kMacroblockSize;
+            length = std::max(std::min(length, maxLength), kMacroblockSize);
+            start = std::max(std::min(start, bound - length), 0);
+            return std::make_pair(start, length);
+        };
+
+        const auto clipped = region.intersected(QRect(QPoint(0, 0), bounds));
+        if (clipped.isEmpty()) {
+            return QRect();
+        }
+        const auto x = align(clipped.x(), clipped.width(), bounds.width());
+        const auto y = align(clipped.y(), clipped.height(), bounds.height());
+        return QRect(x.first, y.first, x.second, y.second);
+    }
 Q_SIGNALS:
     virtual void started(int width, int height, double framerate) = 0;
     virtual void bufferAvailable(const Buffer::Ptr &buffer) = 0;
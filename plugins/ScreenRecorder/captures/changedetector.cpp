@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "changedetector.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+static constexpr int kTileBytes = 128;
+static constexpr int kTileRows = 32;
+static constexpr int kLanes = 4;
+static constexpr int kBlockSize = 16;
+
+inline uint32_t rotate(uint32_t value)
+{
+    return (value << 5) | (value >> 27);
+}
+
+// Folds one 16 byte block into the four lanes, like the vector paths do
+inline void hashBlockScalar(const uint8_t *p, uint32_t *lanes)
+{
+    uint32_t words[kLanes];
+    ::memcpy(words, p, sizeof(words));
+    for (int i = 0; i < kLanes; i++) {
+        lanes[i] = rotate(lanes[i]) ^ words[i];
+    }
+}
+
+// Shifting the lanes before each block keeps the position of a byte in
+// the hash, so two changes in one tile hardly ever cancel out.
+void hashTile(const uint8_t *p, int length, uint32_t *lanes)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes));
+    for (; i + kBlockSize <= length; i += kBlockSize) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        acc = _mm_xor_si128(_mm_or_si128(_mm_slli_epi32(acc, 5), _mm_srli_epi32(acc, 27)), v);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t acc = vld1q_u32(lanes);
+    for (; i + kBlockSize <= length; i += kBlockSize) {
+        const uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(p + i));
+        acc = veorq_u32(vsliq_n_u32(vshrq_n_u32(acc, 27), acc, 5), v);
+    }
+    vst1q_u32(lanes, acc);
+#else
+    for (; i + kBlockSize <= length; i += kBlockSize) {
+        hashBlockScalar(p + i, lanes);
+    }
+#endif
+
+    if (i < length) {
+        uint8_t tail[kBlockSize] = {};
+        ::memcpy(tail, p + i, length - i);
+        hashBlockScalar(tail, lanes);
+    }
+}
+} // namespace
+
+ChangeDetector::ChangeDetector(int rowStep)
+    : m_rowStep(std::max(rowStep, 1))
+{
+}
+
+bool ChangeDetector::update(const MappedFrame &frame, int bytesPerPixel)
+{
+    const int rowBytes = frame.width * bytesPerPixel;
+    const int tilesX = (rowBytes + kTileBytes - 1) / kTileBytes;
+    const int tilesY = (frame.height + kTileRows - 1) / kTileRows;
+    const size_t count = static_cast<size_t>(tilesX) * tilesY * kLanes;
+
+    bool changed = false;
+    if (rowBytes != m_rowBytes || frame.height != m_height || m_hashes.size() != count) {
+        m_rowBytes = rowBytes;
+        m_height = frame.height;
+        m_hashes.assign(count, 0);
+        changed = true;
+    }
+    m_current.assign(count, 0);
+
+    for (int y = 0; y < frame.height; y += m_rowStep) {
+        const uint8_t *row = frame.pixels + static_cast<size_t>(y) * frame.stride;
+        uint32_t *lanes = m_current.data() + static_cast<size_t>(y / kTileRows) * tilesX * kLanes;
+        for (int x = 0; x < rowBytes; x += kTileBytes, lanes += kLanes) {
+            hashTile(row + x, std::min(kTileBytes, rowBytes - x), lanes);
+        }
+    }
+
+    if (!changed) {
+        changed = ::memcmp(m_current.data(), m_hashes.data(), count * sizeof(uint32_t)) != 0;
+    }
+    m_hashes.swap(m_current);
+    return changed;
+}
+
+void ChangeDetector::reset()
+{
+    m_rowBytes = 0;
+    m_height = 0;
+    m_hashes.clear();
+}
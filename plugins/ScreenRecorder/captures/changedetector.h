@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CAPTURES_CHANGEDETECTOR_H
+#define CAPTURES_CHANGEDETECTOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "../non_copyable.h"
+#include "bufferstream.h"
+
+// Tells whether a frame differs from the previous one. The frame is cut
+// into tiles of 32 pixels by 32 rows and every rowStep-th row of a tile
+// is hashed, so only a fraction of the frame is read. A change confined
+// to the rows in between goes unnoticed, which the keepalive of the
+// caller papers over.
+class ChangeDetector : public NonCopyable
+{
+public:
+    explicit ChangeDetector(int rowStep = 4);
+
+    // Hashes frame and compares it with the previous one. The first frame
+    // and frames of a different size always count as changed.
+    bool update(const MappedFrame &frame, int bytesPerPixel);
+    void reset();
+
+private:
+    const int m_rowStep;
+    int m_rowBytes = 0;
+    int m_height = 0;
+    // Four hash lanes per tile, for the previous and the current frame
+    std::vector<uint32_t> m_hashes;
+    std::vector<uint32_t> m_current;
+};
+
+#endif // CAPTURES_CHANGEDETECTOR_H
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "microphone.h"
+
+#include <QAudioDeviceInfo>
+#include <QDebug>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+// Well above the jitter of QAudioInput reads, below noticeable lip sync
+// errors.
+static constexpr int64_t kMaxDrift = 60000;
+static constexpr int64_t kDriftReportInterval = 10000000;
+} // namespace
+
+MicrophoneCapture::MicrophoneCapture(QObject *parent) : QObject(parent)
+{
+}
+
+MicrophoneCapture::~MicrophoneCapture()
+{
+    stop();
+}
+
+void MicrophoneCapture::configure(const QAudioFormat &format)
+{
+    const bool unsigned8 = format.sampleSize() == 8 && format.sampleType() == QAudioFormat::UnSignedInt;
+    const bool signed16 = format.sampleSize() == 16 && format.sampleType() == QAudioFormat::SignedInt &&
+                          format.byteOrder() == QAudioFormat::LittleEndian;
+    if (!unsigned8 && !signed16) {
+        qCritical() << "unsupported microphone format" << format;
+        throw std::runtime_error("unsupported microphone format");
+    }
+
+    m_converter.reset(new AacConverter(format.sampleRate(), format.channelCount(), format.sampleSize()));
+    m_format = format;
+}
+
+QByteArray MicrophoneCapture::decoderSpecificInfo() const
+{
+    return m_converter ? m_converter->decoderSpecificInfo() : QByteArray();
+}
+
+void MicrophoneCapture::start()
+{
+    if (!m_converter || m_input) {
+        return;
+    }
+    if (!m_clock) {
+        m_clock = MediaClock::create();
+        m_clock->start();
+    }
+
+    m_input.reset(new QAudioInput(QAudioDeviceInfo::defaultInputDevice(), m_format));
+    connect(m_input.data(), &QAudioInput::stateChanged, this, [](QAudio::State state) {
+        qDebug() << "QAudioInput state changed:" << state;
+    });
+
+    m_device = m_input->start();
+    if (!m_device) {
+        qCritical() << "failed to start the microphone:" << m_input->error();
+        m_input.reset();
+        return;
+    }
+    connect(m_device, &QIODevice::readyRead, this, &MicrophoneCapture::readAudio);
+    m_samples = 0;
+    m_partialBytes = 0;
+    m_drift = 0;
+    m_lastDriftReport = 0;
+
+    qDebug() << "microphone started";
+}
+
+void MicrophoneCapture::stop()
+{
+    if (!m_input) {
+        return;
+    }
+
+    // Whatever is still buffered belongs to the recording
+    readAudio();
+    m_converter->flush(m_packets);
+    emitPackets();
+    m_input->stop();
+    m_device = nullptr;
+    m_input.reset();
+
+    qDebug() << "microphone stopped";
+}
+
+void MicrophoneCapture::readAudio()
+{
+    if (!m_device) {
+        return;
+    }
+
+    const auto available = m_device->bytesAvailable();
+    if (available <= 0) {
+        return;
+    }
+    if (m_pcm.size() < static_cast<size_t>(available)) {
+        m_pcm.resize(available);
+    }
+
+    const auto length = m_device->read(reinterpret_cast<char *>(m_pcm.data()), available);
+    if (length <= 0) {
+        return;
+    }
+
+    if (m_clock->isPaused()) {
+        return;
+    }
+
+    // The samples just read end about now. The first read lines the
+    // track up with the clock, later ones only correct larger errors.
+    const auto stride = m_format.bytesPerFrame();
+    const uint8_t *data = m_pcm.data();
+    int64_t bytes = length;
+    const auto now = m_clock->now();
+    m_drift = now - samplesToTime(m_samples + (m_partialBytes + bytes) / stride);
+    const auto threshold = m_samples == 0 ? 0 : kMaxDrift;
+    if (m_drift > threshold) {
+        const auto silence = timeToSamples(m_drift);
+        m_converter->encodeSilence(silence, m_packets);
+        m_samples += silence;
+    } else if (m_drift < -threshold) {
+        const auto surplus = std::min<int64_t>(timeToSamples(-m_drift), bytes / stride);
+        data += surplus * stride;
+        bytes -= surplus * stride;
+    }
+    if (threshold > 0 && std::abs(m_drift) > threshold) {
+        qWarning() << "corrected microphone drift of" << m_drift << "us";
+    }
+    if (now - m_lastDriftReport >= kDriftReportInterval) {
+        qDebug() << "microphone drift" << m_drift << "us";
+        m_lastDriftReport = now;
+    }
+
+    m_converter->encode(data, bytes, m_packets);
+    m_samples += (m_partialBytes + bytes) / stride;
+    m_partialBytes = (m_partialBytes + bytes) % stride;
+    emitPackets();
+}
+
+int64_t MicrophoneCapture::samplesToTime(int64_t samples) const
+{
+    return samples * 1000000 / m_format.sampleRate();
+}
+
+int64_t MicrophoneCapture::timeToSamples(int64_t time) const
+{
+    return time * m_format.sampleRate() / 1000000;
+}
+
+void MicrophoneCapture::emitPackets()
+{
+    for (const auto &packet : m_packets) {
+        Q_EMIT bufferAvailable(packet);
+    }
+    m_packets.clear();
+}
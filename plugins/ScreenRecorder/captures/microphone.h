@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CAPTURES_MICROPHONE_H
+#define CAPTURES_MICROPHONE_H
+
+#include <QAudioFormat>
+#include <QAudioInput>
+#include <QByteArray>
+#include <QObject>
+#include <QScopedPointer>
+#include <memory>
+#include <vector>
+
+#include "../aacconverter.h"
+#include "../buffer.h"
+#include "../mediaclock.h"
+
+// Records the default input device and encodes it to AAC on the fly.
+// Every AAC frame is emitted as its own buffer.
+//
+// The audio track starts at media time zero. The sample count is checked
+// against the clock on every read, gaps are filled with silence and
+// surplus samples dropped once they are off by more than kMaxDrift.
+class MicrophoneCapture : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MicrophoneCapture(QObject *parent = nullptr);
+    ~MicrophoneCapture();
+
+    // Sets up the encoder, the decoder specific info is available right
+    // after. Throws std::runtime_error if the format can't be encoded.
+    void configure(const QAudioFormat &format);
+    QAudioFormat format() const { return m_format; }
+    QByteArray decoderSpecificInfo() const;
+    // Must be set before start(), audio read while it's paused is dropped
+    void setClock(const MediaClock::Ptr &clock) { m_clock = clock; }
+    // Media time minus the time covered by the samples so far, in
+    // microseconds. Positive if the microphone fell behind.
+    int64_t drift() const { return m_drift; }
+
+Q_SIGNALS:
+    void bufferAvailable(const Buffer::Ptr &buffer);
+
+public Q_SLOTS:
+    // Both have to run on the thread the capture lives on
+    void start();
+    void stop();
+
+private Q_SLOTS:
+    void readAudio();
+
+private:
+    void emitPackets();
+    int64_t samplesToTime(int64_t samples) const;
+    int64_t timeToSamples(int64_t time) const;
+
+    QAudioFormat m_format;
+    MediaClock::Ptr m_clock;
+    std::unique_ptr<AacConverter> m_converter;
+    QScopedPointer<QAudioInput> m_input;
+    QIODevice *m_device = nullptr;
+    // Scratch space, kept to avoid reallocating for every read
+    std::vector<uint8_t> m_pcm;
+    std::vector<Buffer::Ptr> m_packets;
+    // Samples passed to the encoder, including inserted silence
+    int64_t m_samples = 0;
+    int64_t m_partialBytes = 0;
+    int64_t m_drift = 0;
+    int64_t m_lastDriftReport = 0;
+};
+
+#endif // CAPTURES_MICROPHONE_H
@@ -18,10 +18,78 @@
 #include "mir.h"
 
 #include <QDebug>
+#include <algorithm>
 
 namespace {
 static constexpr const char *kMirSocket{ "/run/mir_socket" };
 static constexpr const char *kMirConnectionName{ "screencapture client" };
+static constexpr unsigned int kMaxPixelFormats = 16;
+
+// Mir names formats after the packed 32 bit word, in memory the byte
+// order is reversed on little endian. Only 32 bit formats can be read
+// back and converted.
+bool toPixelFormat(MirPixelFormat mirFormat, PixelFormat &format)
+{
+    switch (mirFormat) {
+    case mir_pixel_format_argb_8888:
+        format = PixelFormat::BGRA8888;
+        return true;
+    case mir_pixel_format_xrgb_8888:
+        format = PixelFormat::BGRX8888;
+        return true;
+    case mir_pixel_format_xbgr_8888:
+        format = PixelFormat::RGBX8888;
+        return true;
+    case mir_pixel_format_abgr_8888:
+        format = PixelFormat::RGBA8888;
+        return true;
+    default:
+        return false;
+    }
+}
+
+class MirScreencastStream : public BufferStream
+{
+public:
+    explicit MirScreencastStream(MirBufferStream *stream) : m_stream(stream) {}
+
+    bool swapBuffers(const SwapCallback &done) override
+    {
+        m_done = done;
+        mir_buffer_stream_swap_buffers(m_stream, &MirScreencastStream::swapped, this);
+        return true;
+    }
+
+    void *nativeBuffer() override
+    {
+        MirNativeBuffer *buffer = nullptr;
+        mir_buffer_stream_get_current_buffer(m_stream, &buffer);
+        return buffer;
+    }
+
+    bool map(MappedFrame &frame) override
+    {
+        MirGraphicsRegion region;
+        if (!mir_buffer_stream_get_graphics_region(m_stream, &region) || !region.vaddr) {
+            return false;
+        }
+        frame.pixels = reinterpret_cast<const uint8_t *>(region.vaddr);
+        frame.width = region.width;
+        frame.height = region.height;
+        frame.stride = region.stride;
+        return true;
+    }
+
+private:
+    static void swapped(MirBufferStream *stream, void *context)
+    {
+        Q_UNUSED(stream);
+        static_cast<MirScreencastStream *>(context)->m_done();
+    }
+
+    MirBufferStream *m_stream;
+    SwapCallback m_done;
+};
 } // namespace
 
 CaptureMir::CaptureMir()
@@ -93,10 +161,33 @@ void CaptureMir::init()
 
     m_displayMode = displayMode;
     m_activeOutput = activeOutput;
+
+    // Take the server's most preferred format which we know the layout of
+    MirPixelFormat formats[kMaxPixelFormats];
+    unsigned int numPixelFormats = 0;
+    mir_connection_get_available_surface_formats(m_connection, formats, kMaxPixelFormats,
+                                                 &numPixelFormats);
+    m_pixelFormat = mir_pixel_format_invalid;
+    for (unsigned int i = 0; i < numPixelFormats; i++) {
+        PixelFormat format;
+        if (toPixelFormat(formats[i], format)) {
+            m_pixelFormat = formats[i];
+            break;
+        }
+    }
+    if (m_pixelFormat == mir_pixel_format_invalid) {
+        qCritical() << "no supported 32 bit pixel format among" << numPixelFormats
+                    << "offered:" << mir_connection_get_error_message(m_connection);
+    }
 }
 
 void CaptureMir::start()
 {
+    if (m_pixelFormat == mir_pixel_format_invalid) {
+        qCritical() << "no usable pixel format, not starting capture";
+        return;
+    }
+
     auto spec = mir_create_screencast_spec(m_connection);
     if (!spec) {
         qCritical() << "failed to create Mir screencast specification:"
@@ -104,32 +195,25 @@ void CaptureMir::start()
         return;
     }
 
-    mir_screencast_spec_set_width(spec, m_displayMode->horizontal_resolution);
-    mir_screencast_spec_set_height(spec, m_displayMode->vertical_resolution);
+    // Captured 1:1, a smaller region means fewer pixels all the way down
+    const auto captured = captureRegion();
+    mir_screencast_spec_set_width(spec, captured.width());
+    mir_screencast_spec_set_height(spec, captured.height());
 
     MirRectangle region;
     // If we request a screen region outside the available screen area
     // mir will create a mir output which is then available for everyone
     // as just another display.
-    region.left = m_activeOutput->position_x;
-    region.top = m_activeOutput->position_y;
-    region.width = m_displayMode->horizontal_resolution;
-    region.height = m_displayMode->vertical_resolution;
+    region.left = m_activeOutput->position_x + captured.x();
+    region.top = m_activeOutput->position_y + captured.y();
+    region.width = captured.width();
+    region.height = captured.height();
 
     mir_screencast_spec_set_capture_region(spec, &region);
 
-    unsigned int numPixelFormats = 0;
-    MirPixelFormat pixelFormat;
-    mir_connection_get_available_surface_formats(m_connection, &pixelFormat, 1, &numPixelFormats);
-    if (numPixelFormats == 0) {
-        qCritical() << "failed to find suitable pixel format:"
-                    << mir_connection_get_error_message(m_connection);
-        return;
-    }
-
-    mir_screencast_spec_set_pixel_format(spec, pixelFormat);
+    mir_screencast_spec_set_pixel_format(spec, m_pixelFormat);
     mir_screencast_spec_set_mirror_mode(spec, mir_mirror_mode_vertical);
-    mir_screencast_spec_set_number_of_buffers(spec, 1);
+    mir_screencast_spec_set_number_of_buffers(spec, m_bufferCount);
 
     m_screencast = mir_screencast_create_sync(spec);
     mir_screencast_spec_release(spec);
@@ -145,16 +229,39 @@ void CaptureMir::start()
         return;
     }
 
-    m_elapsed.restart();
+    // Without a shared clock the capture keeps its own timeline
+    if (!m_clock) {
+        m_clock = MediaClock::create();
+        m_clock->start();
+    }
+
+    ScreencastPipeline::Config config;
+    config.width = captured.width();
+    config.height = captured.height();
+    config.format = pixelFormat();
+    config.cpuReadback = m_cpuReadback;
+    config.skipStaticFrames = m_skipStaticFrames;
+    config.maxStaticGap = static_cast<int64_t>(m_maxStaticGapMs) * 1000;
+    m_pipeline.reset(new ScreencastPipeline(
+            std::unique_ptr<BufferStream>(new MirScreencastStream(m_bufferStream)), config, m_clock,
+            [this](const Buffer::Ptr &buffer) { Q_EMIT bufferAvailable(buffer); },
+            [this]() { QMetaObject::invokeMethod(this, "swapCompleted", Qt::QueuedConnection); }));
 
     qDebug() << "started mir capture";
-    Q_EMIT started(m_displayMode->horizontal_resolution,
-                   m_displayMode->vertical_resolution,
-                   m_displayMode->refresh_rate);
+    Q_EMIT started(captured.width(), captured.height(), m_displayMode->refresh_rate);
 }
 
 void CaptureMir::stop()
 {
+    // Waits for the compositor, the screencast has to outlive the swap
+    if (m_pipeline) {
+        const auto stats = m_pipeline->stats();
+        qDebug() << "mir capture:" << stats.frames << "frames, skipped" << stats.compositorBusy
+                 << "waiting for the compositor and" << stats.encoderBusy << "for the encoder,"
+                 << stats.unchanged << "unchanged frames dropped";
+        m_pipeline.reset();
+    }
+
     if (m_screencast) {
         mir_screencast_release_sync(m_screencast);
     }
@@ -163,30 +270,62 @@ void CaptureMir::stop()
     m_bufferStream = nullptr;
     m_activeOutput = nullptr;
     m_displayMode = nullptr;
-    m_elapsed.invalidate();
 }
 
 void CaptureMir::swapBuffers()
 {
-    qDebug() << "swapping buffers";
-    if (!m_bufferStream) {
+    if (!m_pipeline || m_clock->isPaused()) {
         return;
     }
-    mir_buffer_stream_swap_buffers_sync(m_bufferStream);
-    MirNativeBuffer *buffer = nullptr;
-    mir_buffer_stream_get_current_buffer(m_bufferStream, &buffer);
+    m_pipeline->frameDue();
+}
 
-    const auto wrappedBuffer = Buffer::Create(reinterpret_cast<void *>(buffer));
-    wrappedBuffer->SetTimestamp(m_elapsed.elapsed() * 1000);
-    Q_EMIT bufferAvailable(wrappedBuffer);
+void CaptureMir::swapCompleted()
+{
+    if (m_pipeline) {
+        m_pipeline->deliver();
+    }
+}
+
+PixelFormat CaptureMir::pixelFormat() const
+{
+    // init() only ever picks a format we can map, the fallback is for a
+    // capture without any format, which refuses to start.
+    PixelFormat format = PixelFormat::RGBA8888;
+    toPixelFormat(m_pixelFormat, format);
+    return format;
 }
 
 int CaptureMir::width()
 {
-    return m_displayMode->horizontal_resolution;
+    return captureRegion().width();
 }
 
 int CaptureMir::height()
 {
-    return m_displayMode->vertical_resolution;
+    return captureRegion().height();
+}
+
+void CaptureMir::setRegion(const QRect &region)
+{
+    if (!m_displayMode) {
+        qWarning() << "no active output, ignoring capture region";
+        return;
+    }
+
+    const QSize output(m_displayMode->horizontal_resolution, m_displayMode->vertical_resolution);
+    m_region = region.isNull() ? QRect() : alignRegion(region, output);
+    if (!region.isNull() && m_region.isNull()) {
+        qWarning() << "capture region" << region << "is outside of the output, capturing all of it";
+    } else if (m_region != region) {
+        qDebug() << "capture region" << region << "aligned to" << m_region;
+    }
+}
+
+QRect CaptureMir::captureRegion() const
+{
+    if (!m_region.isNull()) {
+        return m_region;
+    }
+    return QRect(0, 0, m_displayMode->horizontal_resolution, m_displayMode->vertical_resolution);
 }
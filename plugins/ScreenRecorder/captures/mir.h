@@ -19,8 +19,11 @@
 #define CAPTURES_MIR_H
 
 #include <QObject>
-#include <QElapsedTimer>
+#include <algorithm>
+#include <memory>
 #include "capture.h"
+#include "screencastpipeline.h"
+#include "../pixelformat.h"
 
 #include <mir_toolkit/mir_client_library.h>
 #include <mir_toolkit/mir_screencast.h>
@@ -37,6 +40,25 @@ public:
     void init() override;
     int width() override;
     int height() override;
+    void setClock(const MediaClock::Ptr &clock) override { m_clock = clock; }
+    void setRegion(const QRect &region) override;
+    // Copy every frame into system memory instead of passing the native
+    // buffer on, for encoders that can't consume GPU buffers.
+    void setCpuReadback(bool enabled) { m_cpuReadback = enabled; }
+    bool cpuReadback() const { return m_cpuReadback; }
+    // Buffers of the screencast, must be set before start(). With more
+    // than one the compositor can fill the next frame while the encoder
+    // still reads the current one.
+    void setBufferCount(int count) { m_bufferCount = std::max(count, 1); }
+    // Don't hand on frames which look like the previous one, but at least
+    // one every maxGapMs. Must be set before start().
+    void setSkipStaticFrames(bool enabled, int maxGapMs = 1000)
+    {
+        m_skipStaticFrames = enabled;
+        m_maxStaticGapMs = std::max(maxGapMs, 0);
+    }
+    // Layout of the frames emitted in CPU readback mode, valid after init()
+    PixelFormat pixelFormat() const;
 Q_SIGNALS:
     void started(int width, int height, double framerate) override;
     void bufferAvailable(const Buffer::Ptr &buffer) override;
@@ -45,13 +67,26 @@ public Q_SLOTS:
     void stop() override;
     void swapBuffers() override;
 
+private Q_SLOTS:
+    void swapCompleted();
+
 private:
+    // Captured part of the active output, in output coordinates
+    QRect captureRegion() const;
+
     MirConnection *m_connection = nullptr;
     MirScreencast *m_screencast = nullptr;
     MirBufferStream *m_bufferStream = nullptr;
     MirDisplayMode *m_displayMode = nullptr;
     MirDisplayOutput *m_activeOutput = nullptr;
-    QElapsedTimer m_elapsed;
+    MirPixelFormat m_pixelFormat = mir_pixel_format_invalid;
+    QRect m_region;
+    std::unique_ptr<ScreencastPipeline> m_pipeline;
+    MediaClock::Ptr m_clock;
+    bool m_cpuReadback = false;
+    int m_bufferCount = 3;
+    bool m_skipStaticFrames = false;
+    int m_maxStaticGapMs = 1000;
 };
 
 #endif // CAPTURES_MIR_H
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "screencastpipeline.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace {
+static constexpr uint32_t kReadbackBufferCount = 3;
+static constexpr std::chrono::seconds kSwapTimeout{ 1 };
+} // namespace
+
+// Marks a native buffer as returned once the encoder released it
+class ScreencastPipeline::ReturnTracker : public Buffer::Delegate
+{
+public:
+    void OnBufferFinished(const Buffer::Ptr &buffer) override
+    {
+        Q_UNUSED(buffer);
+        held.store(false);
+    }
+
+    std::atomic<bool> held{ false };
+};
+
+ScreencastPipeline::ScreencastPipeline(std::unique_ptr<BufferStream> stream, const Config &config,
+                                       const MediaClock::Ptr &clock, const FrameCallback &frame,
+                                       const CompletionCallback &completion)
+    : m_stream(std::move(stream)),
+      m_config(config),
+      m_clock(clock),
+      m_frame(frame),
+      m_completion(completion),
+      m_tracker(std::make_shared<ReturnTracker>())
+{
+    if (m_config.cpuReadback) {
+        const auto frameSize = m_config.width * m_config.height * bytesPerPixel(m_config.format);
+        m_pool = BufferPool::Create(frameSize, kReadbackBufferCount);
+    }
+    if (m_config.skipStaticFrames) {
+        m_detector.reset(new ChangeDetector());
+    }
+}
+
+ScreencastPipeline::~ScreencastPipeline()
+{
+    std::unique_lock<std::mutex> l(m_mutex);
+    if (!m_completed.wait_for(l, kSwapTimeout, [this] { return !m_inFlight; })) {
+        qWarning() << "compositor didn't complete the last swap";
+    }
+}
+
+void ScreencastPipeline::frameDue()
+{
+    if (m_swapPending) {
+        m_stats.compositorBusy++;
+        return;
+    }
+    if (m_tracker->held.load()) {
+        m_stats.encoderBusy++;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_inFlight = true;
+    }
+    m_swapPending = true;
+    m_requestedAt = m_clock->now();
+
+    // The destructor may run as soon as m_inFlight is cleared, so that's
+    // the last thing the callback does.
+    const bool started = m_stream->swapBuffers([this]() {
+        m_completion();
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_inFlight = false;
+        m_completed.notify_all();
+    });
+    if (!started) {
+        qWarning() << "failed to swap screencast buffers";
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_inFlight = false;
+        m_swapPending = false;
+    }
+}
+
+void ScreencastPipeline::deliver()
+{
+    if (!m_swapPending) {
+        return;
+    }
+    m_swapPending = false;
+
+    // Readback and change detection share one mapping of the buffer
+    MappedFrame frame;
+    if (m_config.cpuReadback || m_detector) {
+        if (!m_stream->map(frame) || !frame.pixels) {
+            if (m_config.cpuReadback) {
+                qWarning() << "failed to map screencast buffer";
+                return;
+            }
+            // Some native buffers can't be mapped, encode them all then
+            qWarning() << "can't map screencast buffers, static frames won't be skipped";
+            m_detector.reset();
+        }
+    }
+
+    if (m_detector && isStatic(frame)) {
+        m_stats.unchanged++;
+        return;
+    }
+
+    Buffer::Ptr buffer;
+    if (m_config.cpuReadback) {
+        buffer = readback(frame);
+    } else if (auto native = m_stream->nativeBuffer()) {
+        buffer = Buffer::Create(native);
+        buffer->SetTimestamp(m_requestedAt);
+        buffer->SetDelegate(m_tracker);
+        m_tracker->held.store(true);
+    }
+
+    if (buffer) {
+        m_stats.frames++;
+        m_deliveredAt = m_requestedAt;
+        m_frame(buffer);
+    }
+}
+
+bool ScreencastPipeline::isStatic(const MappedFrame &frame)
+{
+    // Always hash, the next frame is compared against this one
+    const bool changed = m_detector->update(frame, bytesPerPixel(m_config.format));
+    if (changed || m_stats.frames == 0) {
+        return false;
+    }
+    // The muxer stretches the last sample until the next one arrives, the
+    // keepalive bounds that and shows a change the sampling missed.
+    return m_requestedAt - m_deliveredAt < m_config.maxStaticGap;
+}
+
+Buffer::Ptr ScreencastPipeline::readback(const MappedFrame &frame)
+{
+    const auto buffer = m_pool->Acquire(m_requestedAt);
+    if (!buffer) {
+        qWarning() << "failed to allocate readback buffer";
+        return nullptr;
+    }
+
+    // The pool is sized for the configured frame, never copy more than that
+    const auto width = std::min(frame.width, m_config.width);
+    const auto height = std::min(frame.height, m_config.height);
+    const auto rowSize = static_cast<size_t>(width) * bytesPerPixel(m_config.format);
+    if (frame.stride == static_cast<int>(rowSize)) {
+        ::memcpy(buffer->Data(), frame.pixels, rowSize * height);
+    } else {
+        for (int y = 0; y < height; y++) {
+            ::memcpy(buffer->Data() + y * rowSize, frame.pixels + y * frame.stride, rowSize);
+        }
+    }
+
+    return buffer;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CAPTURES_SCREENCASTPIPELINE_H
+#define CAPTURES_SCREENCASTPIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "../buffer.h"
+#include "../bufferpool.h"
+#include "../mediaclock.h"
+#include "../non_copyable.h"
+#include "../pixelformat.h"
+#include "bufferstream.h"
+#include "changedetector.h"
+
+// Drives a screencast buffer stream without ever blocking on the
+// compositor. A frame deadline only starts an asynchronous swap; the
+// frame is delivered once the compositor made the next buffer current.
+//
+// Native buffers go to the encoder as they are and the stream isn't
+// swapped again before the encoder released the buffer, so the
+// compositor never draws into a buffer which is still being encoded.
+// Readback copies into pooled memory, the stream is free again right
+// after.
+class ScreencastPipeline : public NonCopyable
+{
+public:
+    typedef std::function<void(const Buffer::Ptr &)> FrameCallback;
+    // Must get deliver() called on the pacing thread
+    typedef std::function<void()> CompletionCallback;
+
+    class Config
+    {
+    public:
+        Config()
+            : width(0),
+              height(0),
+              format(PixelFormat::RGBA8888),
+              cpuReadback(false),
+              skipStaticFrames(false),
+              maxStaticGap(1000000)
+        {
+        }
+
+        int width;
+        int height;
+        // Layout of the frames
+        PixelFormat format;
+        bool cpuReadback;
+        // Drop frames which look the same as the last delivered one
+        bool skipStaticFrames;
+        // Microseconds after which an unchanged frame is delivered anyway
+        int64_t maxStaticGap;
+    };
+
+    struct Stats
+    {
+        uint64_t frames = 0;
+        // Deadlines skipped while the compositor was still filling a buffer
+        uint64_t compositorBusy = 0;
+        // Deadlines skipped while the encoder held the current buffer
+        uint64_t encoderBusy = 0;
+        // Frames dropped because nothing changed on screen
+        uint64_t unchanged = 0;
+    };
+
+    ScreencastPipeline(std::unique_ptr<BufferStream> stream, const Config &config,
+                       const MediaClock::Ptr &clock, const FrameCallback &frame,
+                       const CompletionCallback &completion);
+    // Waits for a swap in flight
+    ~ScreencastPipeline();
+
+    // Both on the pacing thread
+    void frameDue();
+    void deliver();
+
+    Stats stats() const { return m_stats; }
+
+private:
+    class ReturnTracker;
+
+    Buffer::Ptr readback(const MappedFrame &frame);
+    bool isStatic(const MappedFrame &frame);
+
+    std::unique_ptr<BufferStream> m_stream;
+    const Config m_config;
+    MediaClock::Ptr m_clock;
+    FrameCallback m_frame;
+    CompletionCallback m_completion;
+    BufferPool::Ptr m_pool;
+    std::shared_ptr<ReturnTracker> m_tracker;
+    std::unique_ptr<ChangeDetector> m_detector;
+
+    // Swap requested and not delivered yet
+    bool m_swapPending = false;
+    int64_t m_requestedAt = 0;
+    int64_t m_deliveredAt = 0;
+    Stats m_stats;
+
+    // Swap the compositor hasn't completed yet
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+    bool m_inFlight = false;
+};
+
+#endif // CAPTURES_SCREENCASTPIPELINE_H
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "synthetic.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Enough for the encoder to hold a couple of frames while we render the next
+static constexpr uint32_t kPoolSize{ 4 };
+static constexpr int kScrollLinesPerFrame{ 4 };
+static constexpr int kDamageBoxDivisor{ 8 };
+} // namespace
+
+CaptureSynthetic::CaptureSynthetic(const Config &config, QObject *parent)
+    : QObject(parent), m_config(config)
+{
+}
+
+CaptureSynthetic::~CaptureSynthetic()
+{
+    stop();
+}
+
+void CaptureSynthetic::init()
+{
+    if (m_config.width <= 0 || m_config.height <= 0 || m_config.framerate <= 0.0) {
+        qCritical() << "invalid synthetic capture configuration" << m_config.width << "x"
+                    << m_config.height << "@" << m_config.framerate;
+        return;
+    }
+
+    renderBase();
+}
+
+void CaptureSynthetic::start()
+{
+    if (m_running) {
+        qWarning() << "tried to start a capture while already started";
+        return;
+    }
+
+    if (m_base.empty())
+        renderBase();
+
+    m_pool = BufferPool::Create(stride() * m_config.height, kPoolSize);
+    m_frame = 0;
+    m_running = true;
+
+    qDebug() << "started synthetic capture";
+    Q_EMIT started(m_config.width, m_config.height, m_config.framerate);
+}
+
+void CaptureSynthetic::stop()
+{
+    m_running = false;
+    m_pool.reset();
+}
+
+void CaptureSynthetic::swapBuffers()
+{
+    if (!m_running)
+        return;
+
+    // Timestamps follow the nominal rate rather than the wall clock so
+    // repeated runs produce identical streams.
+    const auto timestamp = static_cast<int64_t>(m_frame * 1000000.0 / m_config.framerate);
+    auto buffer = m_pool->Acquire(timestamp);
+    if (!buffer) {
+        qWarning() << "failed to allocate synthetic frame";
+        return;
+    }
+
+    render(buffer->Data());
+    m_frame++;
+
+    Q_EMIT bufferAvailable(buffer);
+}
+
+int CaptureSynthetic::width()
+{
+    return m_config.width;
+}
+
+int CaptureSynthetic::height()
+{
+    return m_config.height;
+}
+
+int CaptureSynthetic::stride() const
+{
+    return m_config.width * bytesPerPixel(m_config.format);
+}
+
+void CaptureSynthetic::renderBase()
+{
+    const int w = m_config.width;
+    const int h = m_config.height;
+    const auto bgr = isBgrOrder(m_config.format);
+
+    m_base.resize(static_cast<size_t>(stride()) * h);
+
+    // Diagonal gradient with a grid on top, gives the encoder both smooth
+    // areas and hard edges to deal with.
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = m_base.data() + static_cast<size_t>(y) * stride();
+        for (int x = 0; x < w; x++) {
+            uint8_t r = static_cast<uint8_t>(x * 255 / w);
+            uint8_t g = static_cast<uint8_t>(y * 255 / h);
+            uint8_t b = static_cast<uint8_t>((x + y) * 255 / (w + h));
+            if (x % 64 == 0 || y % 64 == 0)
+                r = g = b = 0xff;
+
+            row[x * 4 + 0] = bgr ? b : r;
+            row[x * 4 + 1] = g;
+            row[x * 4 + 2] = bgr ? r : b;
+            row[x * 4 + 3] = 0xff;
+        }
+    }
+}
+
+void CaptureSynthetic::render(uint8_t *data)
+{
+    const size_t rowBytes = stride();
+    const size_t frameBytes = rowBytes * m_config.height;
+
+    switch (m_config.pattern) {
+    case Pattern::Static:
+        ::memcpy(data, m_base.data(), frameBytes);
+        break;
+    case Pattern::Scrolling: {
+        const size_t offset =
+                (m_frame * kScrollLinesPerFrame) % static_cast<size_t>(m_config.height) * rowBytes;
+        ::memcpy(data, m_base.data() + offset, frameBytes - offset);
+        ::memcpy(data + frameBytes - offset, m_base.data(), offset);
+        break;
+    }
+    case Pattern::Noise: {
+        // xorshift32, cheap enough to not dominate the benchmark
+        auto words = reinterpret_cast<uint32_t *>(data);
+        uint32_t state = m_noiseState;
+        for (size_t n = 0; n < frameBytes / 4; n++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            words[n] = state | 0xff000000u;
+        }
+        m_noiseState = state;
+        break;
+    }
+    case Pattern::PartialDamage: {
+        ::memcpy(data, m_base.data(), frameBytes);
+
+        const int boxWidth = std::max(m_config.width / kDamageBoxDivisor, 1);
+        const int boxHeight = std::max(m_config.height / kDamageBoxDivisor, 1);
+        const int left = static_cast<int>(m_frame * 8 % std::max(m_config.width - boxWidth, 1));
+        const int top = static_cast<int>(m_frame * 4 % std::max(m_config.height - boxHeight, 1));
+        const uint32_t colour = 0xff000000u | static_cast<uint32_t>(m_frame * 0x010305);
+
+        for (int y = top; y < top + boxHeight; y++) {
+            auto row = reinterpret_cast<uint32_t *>(data + y * rowBytes) + left;
+            std::fill(row, row + boxWidth, colour);
+        }
+        break;
+    }
+    }
+}
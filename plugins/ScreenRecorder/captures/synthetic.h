@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CAPTURES_SYNTHETIC_H
+#define CAPTURES_SYNTHETIC_H
+
+#include <QObject>
+#include <vector>
+#include "capture.h"
+#include "../bufferpool.h"
+#include "../pixelformat.h"
+
+// Produces CPU side test frames without needing a display server, so the
+// rest of the pipeline can be exercised and benchmarked on any machine.
+class CaptureSynthetic : public QObject, public Capture
+{
+    Q_OBJECT
+    Q_INTERFACES(Capture)
+public:
+    enum class Pattern {
+        // The same frame over and over
+        Static,
+        // Whole frame moves a few lines every tick
+        Scrolling,
+        // Every pixel changes every tick, worst case for the encoder
+        Noise,
+        // Static background with a small moving rectangle
+        PartialDamage,
+    };
+
+    class Config
+    {
+    public:
+        Config()
+            : width(1280),
+              height(720),
+              format(PixelFormat::RGBA8888),
+              framerate(60.0),
+              pattern(Pattern::Scrolling)
+        {
+        }
+
+        int width;
+        int height;
+        PixelFormat format;
+        double framerate;
+        Pattern pattern;
+    };
+
+    explicit CaptureSynthetic(const Config &config = Config(), QObject *parent = nullptr);
+    ~CaptureSynthetic();
+    void init() override;
+    int width() override;
+    int height() override;
+    PixelFormat pixelFormat() const { return m_config.format; }
+    int stride() const;
+
+Q_SIGNALS:
+    void started(int width, int height, double framerate) override;
+    void bufferAvailable(const Buffer::Ptr &buffer) override;
+
+public Q_SLOTS:
+    void start() override;
+    void stop() override;
+    void swapBuffers() override;
+
+private:
+    void renderBase();
+    void render(uint8_t *data);
+
+    Config m_config;
+    BufferPool::Ptr m_pool;
+    std::vector<uint8_t> m_base;
+    uint64_t m_frame = 0;
+    uint32_t m_noiseState = 0x9e3779b9;
+    bool m_running = false;
+};
+
+#endif // CAPTURES_SYNTHETIC_H
@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "colorconverter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+static constexpr int kMaxThreads = 4;
+static constexpr uint32_t kPoolSize = 3;
+// Output pixels per vector step
+static constexpr int kBlockPixels = 8;
+
+inline uint8_t luma(int r, int g, int b)
+{
+    return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline uint8_t chromaU(int r, int g, int b)
+{
+    return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+inline uint8_t chromaV(int r, int g, int b)
+{
+    return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+// Converts two rows of width pixels, which have to be packed and even.
+// With NV12 u receives interleaved CbCr and v is unused. The vector paths
+// compute exactly what the scalar one does.
+void convertRowPair(const uint8_t *src0, const uint8_t *src1, int width, bool bgr, bool nv12,
+                    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    const int ri = bgr ? 2 : 0;
+    const int bi = bgr ? 0 : 2;
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i lumaOffset = _mm_set1_epi16(16);
+    const int rShift = ri * 8;
+    const int bShift = bi * 8;
+
+    // 8 pixels to one 16 bit lane per pixel and channel
+    const auto load = [&](const uint8_t *p, __m128i &r, __m128i &g, __m128i &b) {
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+        const auto channel = [&](int shift) {
+            const __m128i count = _mm_cvtsi32_si128(shift);
+            return _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(lo, count), byteMask),
+                                   _mm_and_si128(_mm_srl_epi32(hi, count), byteMask));
+        };
+        r = channel(rShift);
+        g = channel(8);
+        b = channel(bShift);
+    };
+    // The sum stays below 2^16, so wrapping 16 bit multiplies are exact
+    const auto storeLuma = [&](__m128i r, __m128i g, __m128i b, uint8_t *dst) {
+        __m128i y = _mm_mullo_epi16(r, _mm_set1_epi16(66));
+        y = _mm_add_epi16(y, _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+        y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+        y = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(y, round), 8), lumaOffset);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(y, zero));
+    };
+    // Average of the 2x2 blocks, in the low four lanes
+    const auto average = [&](__m128i top, __m128i bottom) {
+        const __m128i sum = _mm_add_epi32(_mm_madd_epi16(top, ones), _mm_madd_epi16(bottom, ones));
+        const __m128i avg = _mm_srai_epi32(sum, 2);
+        return _mm_packs_epi32(avg, avg);
+    };
+    // Within -28560..28688, no 16 bit overflow either
+    const auto chroma = [&](__m128i r, __m128i g, __m128i b, int cr, int cg, int cb) {
+        __m128i c = _mm_mullo_epi16(r, _mm_set1_epi16(cr));
+        c = _mm_add_epi16(c, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+        c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+        c = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(c, round), 8), round);
+        return _mm_packus_epi16(c, c);
+    };
+
+    for (; x + kBlockPixels <= width; x += kBlockPixels) {
+        __m128i r0, g0, b0, r1, g1, b1;
+        load(src0 + x * 4, r0, g0, b0);
+        load(src1 + x * 4, r1, g1, b1);
+        storeLuma(r0, g0, b0, y0 + x);
+        storeLuma(r1, g1, b1, y1 + x);
+
+        const __m128i r = average(r0, r1);
+        const __m128i g = average(g0, g1);
+        const __m128i b = average(b0, b1);
+        const __m128i cb = chroma(r, g, b, -38, -74, 112);
+        const __m128i cr = chroma(r, g, b, 112, -94, -18);
+        if (nv12) {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x), _mm_unpacklo_epi8(cb, cr));
+        } else {
+            const int32_t cbWord = _mm_cvtsi128_si32(cb);
+            const int32_t crWord = _mm_cvtsi128_si32(cr);
+            ::memcpy(u + x / 2, &cbWord, 4);
+            ::memcpy(v + x / 2, &crWord, 4);
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const auto storeLuma = [](uint8x8_t r, uint8x8_t g, uint8x8_t b, uint8_t *dst) {
+        uint16x8_t y = vmull_u8(r, vdup_n_u8(66));
+        y = vmlal_u8(y, g, vdup_n_u8(129));
+        y = vmlal_u8(y, b, vdup_n_u8(25));
+        y = vaddq_u16(y, vdupq_n_u16(128));
+        vst1_u8(dst, vadd_u8(vshrn_n_u16(y, 8), vdup_n_u8(16)));
+    };
+    // Average of the 2x2 blocks
+    const auto average = [](uint8x8_t top, uint8x8_t bottom) {
+        return vreinterpret_s16_u16(vshr_n_u16(vpadal_u8(vpaddl_u8(top), bottom), 2));
+    };
+    const auto chroma = [](int16x4_t r, int16x4_t g, int16x4_t b, int16_t cr, int16_t cg,
+                           int16_t cb) {
+        int16x4_t c = vmul_n_s16(r, cr);
+        c = vmla_n_s16(c, g, cg);
+        c = vmla_n_s16(c, b, cb);
+        c = vadd_s16(c, vdup_n_s16(128));
+        return vadd_s16(vshr_n_s16(c, 8), vdup_n_s16(128));
+    };
+
+    for (; x + kBlockPixels <= width; x += kBlockPixels) {
+        const uint8x8x4_t p0 = vld4_u8(src0 + x * 4);
+        const uint8x8x4_t p1 = vld4_u8(src1 + x * 4);
+        storeLuma(p0.val[ri], p0.val[1], p0.val[bi], y0 + x);
+        storeLuma(p1.val[ri], p1.val[1], p1.val[bi], y1 + x);
+
+        const int16x4_t r = average(p0.val[ri], p1.val[ri]);
+        const int16x4_t g = average(p0.val[1], p1.val[1]);
+        const int16x4_t b = average(p0.val[bi], p1.val[bi]);
+        // Cb in the low and Cr in the high half
+        const uint8x8_t c = vqmovun_s16(vcombine_s16(chroma(r, g, b, -38, -74, 112),
+                                                     chroma(r, g, b, 112, -94, -18)));
+        if (nv12) {
+            vst1_u8(u + x, vzip_u8(c, vext_u8(c, c, 4)).val[0]);
+        } else {
+            uint8_t bytes[8];
+            vst1_u8(bytes, c);
+            ::memcpy(u + x / 2, bytes, 4);
+            ::memcpy(v + x / 2, bytes + 4, 4);
+        }
+    }
+#endif
+
+    for (; x < width; x += 2) {
+        int rs = 0, gs = 0, bs = 0;
+        for (int dx = 0; dx < 2; dx++) {
+            const uint8_t *p0 = src0 + (x + dx) * 4;
+            const uint8_t *p1 = src1 + (x + dx) * 4;
+            y0[x + dx] = luma(p0[ri], p0[1], p0[bi]);
+            y1[x + dx] = luma(p1[ri], p1[1], p1[bi]);
+            rs += p0[ri] + p1[ri];
+            gs += p0[1] + p1[1];
+            bs += p0[bi] + p1[bi];
+        }
+        rs >>= 2;
+        gs >>= 2;
+        bs >>= 2;
+        if (nv12) {
+            u[x] = chromaU(rs, gs, bs);
+            u[x + 1] = chromaV(rs, gs, bs);
+        } else {
+            u[x / 2] = chromaU(rs, gs, bs);
+            v[x / 2] = chromaV(rs, gs, bs);
+        }
+    }
+}
+} // namespace
+
+// Runs the bands of one frame on a fixed set of threads, the thread that
+// calls run() works on them as well.
+class ColorConverter::Workers
+{
+public:
+    explicit Workers(int threads)
+    {
+        for (int i = 0; i < threads; i++) {
+            m_threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~Workers()
+    {
+        {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (auto &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void run(int tasks, const std::function<void(int)> &task)
+    {
+        {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_task = &task;
+            m_tasks = tasks;
+            m_next.store(0);
+            m_busy = static_cast<int>(m_threads.size());
+            m_generation++;
+        }
+        m_wake.notify_all();
+
+        runTasks(task);
+
+        std::unique_lock<std::mutex> l(m_mutex);
+        m_done.wait(l, [this]() { return m_busy == 0; });
+        m_task = nullptr;
+    }
+
+private:
+    void runTasks(const std::function<void(int)> &task)
+    {
+        for (int i = m_next.fetch_add(1); i < m_tasks; i = m_next.fetch_add(1)) {
+            task(i);
+        }
+    }
+
+    void work()
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            const std::function<void(int)> *task;
+            {
+                std::unique_lock<std::mutex> l(m_mutex);
+                m_wake.wait(l, [&]() { return m_stopping || m_generation != seen; });
+                if (m_stopping) {
+                    return;
+                }
+                seen = m_generation;
+                task = m_task;
+            }
+
+            runTasks(*task);
+
+            std::lock_guard<std::mutex> l(m_mutex);
+            if (--m_busy == 0) {
+                m_done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(int)> *m_task = nullptr;
+    int m_tasks = 0;
+    std::atomic<int> m_next{ 0 };
+    int m_busy = 0;
+    uint64_t m_generation = 0;
+    bool m_stopping = false;
+};
+
+ColorConverter::ColorConverter(const Config &config) : m_config(config)
+{
+    if (m_config.srcWidth <= 0 || m_config.srcHeight <= 0 || m_config.dstWidth <= 0 ||
+        m_config.dstHeight <= 0 || (m_config.dstWidth & 1) || (m_config.dstHeight & 1)) {
+        throw std::runtime_error("invalid color conversion dimensions");
+    }
+
+    const int rowSize = m_config.srcWidth * bytesPerPixel(m_config.format);
+    if (m_config.srcStride == 0) {
+        m_config.srcStride = rowSize;
+    } else if (m_config.srcStride < rowSize) {
+        throw std::runtime_error("color conversion stride too small");
+    }
+
+    m_rows.resize(m_config.dstHeight);
+    for (int y = 0; y < m_config.dstHeight; y++) {
+        m_rows[y] = static_cast<int>(static_cast<int64_t>(y) * m_config.srcHeight / m_config.dstHeight);
+    }
+    m_scaleX = m_config.srcWidth != m_config.dstWidth;
+    if (m_scaleX) {
+        m_columns.resize(m_config.dstWidth);
+        for (int x = 0; x < m_config.dstWidth; x++) {
+            m_columns[x] = static_cast<uint32_t>(static_cast<int64_t>(x) * m_config.srcWidth /
+                                                 m_config.dstWidth * 4);
+        }
+    }
+
+    int threads = m_config.threads;
+    if (threads <= 0) {
+        threads = std::min<int>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), kMaxThreads);
+    }
+    // A band covers whole row pairs
+    m_bands = std::max(std::min(threads, m_config.dstHeight / 2), 1);
+    if (m_bands > 1) {
+        m_workers.reset(new Workers(m_bands - 1));
+    }
+    if (m_scaleX) {
+        m_scratch.resize(m_bands, std::vector<uint8_t>(static_cast<size_t>(m_config.dstWidth) * 4 * 2));
+    }
+}
+
+ColorConverter::~ColorConverter() = default;
+
+size_t ColorConverter::frameSize() const
+{
+    return static_cast<size_t>(m_config.dstWidth) * m_config.dstHeight * 3 / 2;
+}
+
+void ColorConverter::convert(const uint8_t *src, const Planes &dst)
+{
+    if (!m_workers) {
+        convertBand(src, dst, 0);
+        return;
+    }
+    m_workers->run(m_bands, [&](int band) { convertBand(src, dst, band); });
+}
+
+Buffer::Ptr ColorConverter::convert(const Buffer::Ptr &input)
+{
+    if (!m_pool) {
+        m_pool = BufferPool::Create(frameSize(), kPoolSize);
+    }
+    auto output = m_pool->Acquire(input->Timestamp());
+    if (!output) {
+        return nullptr;
+    }
+
+    const int width = m_config.dstWidth;
+    const int lumaSize = width * m_config.dstHeight;
+    Planes planes;
+    planes.data[0] = output->Data();
+    planes.linesize[0] = width;
+    planes.data[1] = output->Data() + lumaSize;
+    if (m_config.layout == Layout::NV12) {
+        planes.linesize[1] = width;
+        planes.data[2] = nullptr;
+        planes.linesize[2] = 0;
+    } else {
+        planes.linesize[1] = width / 2;
+        planes.data[2] = planes.data[1] + lumaSize / 4;
+        planes.linesize[2] = width / 2;
+    }
+
+    convert(input->Data(), planes);
+    return output;
+}
+
+void ColorConverter::convertBand(const uint8_t *src, const Planes &dst, int band)
+{
+    const int pairs = m_config.dstHeight / 2;
+    const int first = pairs * band / m_bands * 2;
+    const int last = pairs * (band + 1) / m_bands * 2;
+    const bool bgr = isBgrOrder(m_config.format);
+    const bool nv12 = m_config.layout == Layout::NV12;
+    const int width = m_config.dstWidth;
+
+    for (int y = first; y < last; y += 2) {
+        const uint8_t *rows[2] = { src + static_cast<size_t>(m_rows[y]) * m_config.srcStride,
+                                   src + static_cast<size_t>(m_rows[y + 1]) * m_config.srcStride };
+        if (m_scaleX) {
+            // Gather the nearest source pixels first, the conversion wants
+            // them packed
+            for (int i = 0; i < 2; i++) {
+                uint8_t *scaled = m_scratch[band].data() + i * width * 4;
+                for (int x = 0; x < width; x++) {
+                    ::memcpy(scaled + x * 4, rows[i] + m_columns[x], 4);
+                }
+                rows[i] = scaled;
+            }
+        }
+
+        uint8_t *u = dst.data[1] + (y / 2) * dst.linesize[1];
+        uint8_t *v = nv12 ? nullptr : dst.data[2] + (y / 2) * dst.linesize[2];
+        convertRowPair(rows[0], rows[1], width, bgr, nv12, dst.data[0] + y * dst.linesize[0],
+                       dst.data[0] + (y + 1) * dst.linesize[0], u, v);
+    }
+}
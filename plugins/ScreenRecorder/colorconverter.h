@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COLORCONVERTER_H
+#define COLORCONVERTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "buffer.h"
+#include "bufferpool.h"
+#include "non_copyable.h"
+#include "pixelformat.h"
+
+// Converts packed 32 bit RGB frames to BT.601 limited range YUV 4:2:0 for
+// CPU encoders, scaling to the output size on the way. Chroma is the
+// average of each 2x2 block, scaling picks the nearest source pixel.
+//
+// The output rows are split into bands which are converted in parallel
+// by a few worker threads, the calling thread takes part and convert()
+// returns once the whole frame is done.
+class ColorConverter : public NonCopyable
+{
+public:
+    enum class Layout {
+        // Three planes, as libavcodec and most software encoders want it
+        I420,
+        // Luma plane followed by interleaved CbCr, as hardware encoders do
+        NV12,
+    };
+
+    class Config
+    {
+    public:
+        Config()
+            : srcWidth(0),
+              srcHeight(0),
+              srcStride(0),
+              format(PixelFormat::RGBA8888),
+              dstWidth(0),
+              dstHeight(0),
+              layout(Layout::I420),
+              threads(0)
+        {
+        }
+
+        int srcWidth;
+        int srcHeight;
+        // 0 for tightly packed rows
+        int srcStride;
+        PixelFormat format;
+        // Must be even
+        int dstWidth;
+        int dstHeight;
+        Layout layout;
+        // Including the calling thread, 0 picks one per core up to four
+        int threads;
+    };
+
+    // Destination planes, NV12 only uses the first two
+    struct Planes
+    {
+        uint8_t *data[3];
+        int linesize[3];
+    };
+
+    // Throws std::runtime_error on invalid dimensions
+    explicit ColorConverter(const Config &config);
+    ~ColorConverter();
+
+    const Config &config() const { return m_config; }
+    // Size of a converted frame with the planes back to back
+    size_t frameSize() const;
+
+    // Converts into caller owned planes, e.g. an encoder frame
+    void convert(const uint8_t *src, const Planes &dst);
+    // Converts into a pooled buffer holding the planes back to back, with
+    // the timestamp of the input. Returns nullptr if the pool ran dry.
+    Buffer::Ptr convert(const Buffer::Ptr &input);
+
+private:
+    class Workers;
+
+    void convertBand(const uint8_t *src, const Planes &dst, int band);
+
+    Config m_config;
+    int m_bands = 1;
+    bool m_scaleX = false;
+    // Source row of every output row
+    std::vector<int> m_rows;
+    // Byte offset of the source pixel of every output column
+    std::vector<uint32_t> m_columns;
+    // Two scaled rows per band
+    std::vector<std::vector<uint8_t>> m_scratch;
+    std::unique_ptr<Workers> m_workers;
+    BufferPool::Ptr m_pool;
+};
+
+#endif // COLORCONVERTER_H
@@ -19,53 +19,64 @@
 #include <QDir>
 #include <QDirIterator>
 #include <QFile>
-#include <QProcess>
 #include <QStandardPaths>
 #include <chrono>
+#include <stdexcept>
 
 #include "controller.h"
 #include "buffer.h"
 
-#if defined(__aarch64__)
-#define ARCH_TRIPLET "aarch64-linux-gnu"
-#elif defined(__arm__)
-#define ARCH_TRIPLET "arm-linux-gnueabihf"
-#elif defined(__x86_64__)
-#define ARCH_TRIPLET "x86_64-linux-gnu"
-#elif defined(__i386__)
-#define ARCH_TRIPLET "i386-linux-gnu"
-#else
-#error "No supported architecture detected"
-#endif
-
-Controller::Controller() : m_editing{false}, m_micInput{false}
+Controller::Controller() : m_editing{false}, m_editProgress{0}
 {
     // make directory on launch so users can restart before starting a recording
     // TODO: remove once Lomiri does that itself
     QDir().mkpath(QFileInfo(INDICATOR_PATH).dir().absolutePath());
+
+    m_trimmer = QSharedPointer<Mp4Trimmer>(new Mp4Trimmer());
+    m_trimmer->setMode(Mp4Trimmer::Mode::Exact);
+    m_trimmer->moveToThread(&m_editorThread);
+    connect(m_trimmer.data(), &Mp4Trimmer::progress, this, [this](int percent) {
+        m_editProgress = percent;
+        Q_EMIT editProgressChanged();
+    });
+    connect(m_trimmer.data(), &Mp4Trimmer::finished, this, &Controller::editingFinished);
+    m_editorThread.start();
 }
 
-Controller::~Controller() { }
+Controller::~Controller()
+{
+    m_trimmer->cancel();
+    m_editorThread.quit();
+    m_editorThread.wait();
+}
 
-void Controller::start(float scale, float framerate, bool microphoneInput)
+void Controller::start(float scale, float framerate, bool microphoneInput, const QRect &region)
 {
-    m_micInput = microphoneInput;
     m_capture = QSharedPointer<CaptureMir>(new CaptureMir());
-    m_encoder = QSharedPointer<AndroidH264Encoder>(new AndroidH264Encoder());
     m_mux = QSharedPointer<MuxMp4>(new MuxMp4());
-    m_recorder.setup(m_encoder, m_capture, m_mux);
 
-    auto config = AndroidH264Encoder::defaultConfig();
     m_capture->init();
-    config.width = m_capture->width();
-    config.height = m_capture->height();
-    config.output_scale = scale;
-#if 0
+    // Everything after the capture is sized from the region
+    m_capture->setRegion(region);
+    // Idle screens are common, don't encode the same picture over and over
+    m_capture->setSkipStaticFrames(true);
+
+    // Audio is encoded while recording and muxed next to the video
+    m_microphone.reset();
     if (microphoneInput) {
-        m_mux->setupAudioTrack();
+        try {
+            QSharedPointer<MicrophoneCapture> microphone(new MicrophoneCapture());
+            microphone->configure(m_mux->audioFormat());
+            m_mux->setupAudioTrack(microphone->format(), microphone->decoderSpecificInfo());
+            m_microphone = microphone;
+        } catch (const std::runtime_error &e) {
+            qWarning() << "Recording without audio:" << e.what();
+        }
     }
-#endif
-    m_encoder->configure(config);
+    // The encoder decides whether the capture hands out native or CPU
+    // buffers, so it has to be configured before the pipeline is wired up.
+    m_encoder = createEncoder(scale, framerate);
+    m_recorder.setup(m_encoder, m_capture, m_mux, m_microphone);
 
     const auto dir = QStandardPaths::writableLocation(QStandardPaths::DataLocation);
     {
@@ -78,27 +89,47 @@ void Controller::start(float scale, float framerate, bool microphoneInput)
                          QDateTime::currentDateTime().toString("yyyy_MM_dd__hh_mm_ss_zzz") +
                          QStringLiteral(".mp4");
     m_tmpFileName = dir + QStringLiteral("/tmp.mp4");
-    m_tmpWavName = dir + QStringLiteral("/tmp.wav");
-
-    if (microphoneInput)
-        m_parecord.start("/usr/bin/parecord", QStringList() << m_tmpWavName);
+    m_mux->setTiming(MuxMp4::Timing::Variable, static_cast<int>(framerate));
     m_mux->start(m_tmpFileName, m_capture->width(), m_capture->height());
-    m_recorder.start(framerate, microphoneInput);
+    m_recorder.start(framerate);
 }
 
-void Controller::stop()
+QSharedPointer<QObject> Controller::createEncoder(float scale, float framerate)
 {
-    m_recorder.stop();
-    m_mux->stop();
-    if (m_parecord.state() != QProcess::NotRunning) {
-        m_parecord.kill();
-        m_parecord.waitForFinished();
+    try {
+        auto config = AndroidH264Encoder::defaultConfig();
+        config.width = m_capture->width();
+        config.height = m_capture->height();
+        config.output_scale = scale;
+
+        QSharedPointer<AndroidH264Encoder> encoder(new AndroidH264Encoder());
+        encoder->configure(config);
+        m_capture->setCpuReadback(false);
+        return encoder;
+    } catch (const std::runtime_error &e) {
+        qWarning() << "Hardware encoder unavailable, falling back to software:" << e.what();
     }
 
-    if (m_micInput)
-        mergeVideoAndAudio();
-    else
-        QFile::rename(m_tmpFileName, m_fileName);
+    auto config = AvcodecH264Encoder::defaultConfig();
+    config.width = m_capture->width();
+    config.height = m_capture->height();
+    config.output_scale = scale;
+    config.format = m_capture->pixelFormat();
+    config.framerate = static_cast<int>(framerate);
+
+    QSharedPointer<AvcodecH264Encoder> encoder(new AvcodecH264Encoder());
+    encoder->configure(config);
+    m_capture->setCpuReadback(true);
+    return encoder;
+}
+
+void Controller::stop()
+{
+    m_recorder.stop();
+    // Runs after the buffers still queued for the mux, the file is
+    // complete once this returns.
+    QMetaObject::invokeMethod(m_mux.data(), "stop", Qt::BlockingQueuedConnection);
+    QFile::rename(m_tmpFileName, m_fileName);
 
     Q_EMIT fileSaved(m_fileName);
 }
@@ -120,63 +151,38 @@ void Controller::cleanSpace()
 
 void Controller::cutVideo(const QString path, qint64 from, qint64 to)
 {
+    if (m_editing) {
+        qWarning() << "already editing a video";
+        return;
+    }
+
     m_editing = true;
+    m_editProgress = 0;
     Q_EMIT editingChanged();
+    Q_EMIT editProgressChanged();
 
     const QString editedFile = path + QStringLiteral("_cut.mp4");
+    QMetaObject::invokeMethod(m_trimmer.data(), "trim", Qt::QueuedConnection,
+                              Q_ARG(QString, path), Q_ARG(QString, editedFile),
+                              Q_ARG(qint64, from), Q_ARG(qint64, to));
+}
 
-    // Correction to match seek playback start
-    from = std::max<qint64>(from - 1000, 0);
-
-    QStringList args;
-    args << "-y"
-         << "-ss" << QString::number(from / 1000)
-         << "-to" << QString::number(to / 1000)
-         << "-i" << path
-         << "-c" << "copy" << editedFile;
-
-    QProcess ffmpeg;
-    connect(&ffmpeg, &QProcess::readyReadStandardOutput, this, [&]() {
-        qDebug() << ffmpeg.readAllStandardOutput();
-    }, Qt::DirectConnection);
-    connect(&ffmpeg, &QProcess::readyReadStandardError, this, [&]() {
-        qDebug() << ffmpeg.readAllStandardError();
-    }, Qt::DirectConnection);
-
-    static const QString ffmpegPath = QStringLiteral("./lib/" ARCH_TRIPLET "/bin/ffmpeg");
-    ffmpeg.start(ffmpegPath, args);
-    ffmpeg.waitForFinished();
+void Controller::cancelEditing()
+{
+    if (m_editing)
+        m_trimmer->cancel();
+}
 
+void Controller::editingFinished(bool success, const QString &output)
+{
     m_editing = false;
     Q_EMIT editingChanged();
 
-    if (ffmpeg.exitCode() == 0)
-        Q_EMIT editedFileSaved(editedFile);
+    if (success)
+        Q_EMIT editedFileSaved(output);
 }
 
 bool Controller::isEditing()
 {
     return m_editing;
 }
-
-void Controller::mergeVideoAndAudio()
-{
-    QStringList args;
-    args << "-y"
-         << "-i" << m_tmpFileName
-         << "-i" << m_tmpWavName
-         << "-vcodec" << "copy"
-         << m_fileName;
-
-    QProcess ffmpeg;
-    connect(&ffmpeg, &QProcess::readyReadStandardOutput, this, [&]() {
-        qDebug() << ffmpeg.readAllStandardOutput();
-    }, Qt::DirectConnection);
-    connect(&ffmpeg, &QProcess::readyReadStandardError, this, [&]() {
-        qDebug() << ffmpeg.readAllStandardError();
-    }, Qt::DirectConnection);
-
-    static const QString ffmpegPath = QStringLiteral("./lib/" ARCH_TRIPLET "/bin/ffmpeg");
-    ffmpeg.start(ffmpegPath, args);
-    ffmpeg.waitForFinished();
-}
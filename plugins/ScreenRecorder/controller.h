@@ -19,11 +19,15 @@
 
 #include <QObject>
 #include <QPointer>
-#include <QProcess>
+#include <QRect>
+#include <QThread>
 #include <memory>
 #include "encoders/android_h264.h"
+#include "encoders/avcodec_h264.h"
+#include "captures/microphone.h"
 #include "captures/mir.h"
 #include "muxers/mp4.h"
+#include "muxers/trimmer.h"
 #include "screen_recorder.h"
 
 class Controller : public QObject
@@ -31,35 +35,44 @@ class Controller : public QObject
     Q_OBJECT
 
     Q_PROPERTY(bool editing READ isEditing NOTIFY editingChanged)
+    Q_PROPERTY(int editProgress READ editProgress NOTIFY editProgressChanged)
 
 public:
     Controller();
     ~Controller();
 
-    Q_INVOKABLE void start(float scale, float framerate, bool microphoneInput);
+    // region is in screen coordinates of the recorded output, a null one
+    // records the whole screen
+    Q_INVOKABLE void start(float scale, float framerate, bool microphoneInput,
+                           const QRect &region = QRect());
     Q_INVOKABLE void stop();
     Q_INVOKABLE void cleanSpace();
     Q_INVOKABLE void cutVideo(const QString path, qint64 from, qint64 to);
+    Q_INVOKABLE void cancelEditing();
 
 Q_SIGNALS:
     void fileSaved(const QString path);
     void editingChanged();
+    void editProgressChanged();
     void editedFileSaved(const QString path);
 
 private:
     bool isEditing();
-    void mergeVideoAndAudio();
+    int editProgress() const { return m_editProgress; }
+    void editingFinished(bool success, const QString &output);
+    QSharedPointer<QObject> createEncoder(float scale, float framerate);
 
-    QSharedPointer<AndroidH264Encoder> m_encoder;
+    QSharedPointer<QObject> m_encoder;
     QSharedPointer<CaptureMir> m_capture;
     QSharedPointer<MuxMp4> m_mux;
+    QSharedPointer<MicrophoneCapture> m_microphone;
     ScreenRecorder m_recorder;
     QString m_fileName;
     QString m_tmpFileName;
-    QString m_tmpWavName;
     bool m_editing;
-    bool m_micInput;
-    QProcess m_parecord;
+    int m_editProgress;
+    QSharedPointer<Mp4Trimmer> m_trimmer;
+    QThread m_editorThread;
 };
 
 #endif // CONTROLLER_H
@@ -21,6 +21,7 @@
 
 #include <QDebug>
 #include <memory>
+#include <pthread.h>
 #include <stdexcept>
 
 namespace {
@@ -253,22 +254,30 @@ int AndroidH264Encoder::onSourceRead(MediaBufferWrapper **buffer, void *user_dat
         return kAndroidMediaErrorBufferTooSmall;
     }
 
-    const auto inputBuffer = thiz->m_inputQueue.next();
-    if (!inputBuffer) {
-        return kAndroidMediaErrorEndOfStream;
-    }
+    while (thiz->m_running) {
+        // Wait 1.5 seconds at max until filled as concurrent use of Aethercast
+        // and the screen recorder can cause a deadlock situation as observed
+        // on the Pixel 3a.
+        const auto inputBuffer = thiz->m_inputQueue.next(std::chrono::milliseconds{ 1500 });
+        if (!inputBuffer) {
+            return kAndroidMediaErrorEndOfStream;
+        }
 
-    const auto nextBuffer = thiz->packBuffer(inputBuffer, inputBuffer->Timestamp());
+        // A frame that couldn't be handed over is dropped, ending the
+        // stream for it would end the whole recording.
+        const auto nextBuffer = thiz->packBuffer(inputBuffer, inputBuffer->Timestamp());
+        if (!nextBuffer) {
+            continue;
+        }
 
-    if (!nextBuffer) {
-        return kAndroidMediaErrorEndOfStream;
-    }
+        *buffer = nextBuffer;
 
-    *buffer = nextBuffer;
+        Q_EMIT thiz->beganFrame(inputBuffer->Timestamp());
 
-    Q_EMIT thiz->beganFrame(inputBuffer->Timestamp());
+        return 0;
+    }
 
-    return 0;
+    return kAndroidMediaErrorNotConnected;
 }
 
 void AndroidH264Encoder::onBufferReturned(MediaBufferWrapper *buffer, void *user_data)
@@ -279,14 +288,8 @@ void AndroidH264Encoder::onBufferReturned(MediaBufferWrapper *buffer, void *user
         return;
     }
 
-    // Find the right pending buffer matching the returned one
-    auto iter = thiz->m_pendingBuffers.begin();
-    for (; iter != thiz->m_pendingBuffers.end(); ++iter) {
-        if (iter->mediaBuffer == buffer)
-            break;
-    }
-
-    if (iter == thiz->m_pendingBuffers.end()) {
+    Buffer::Ptr buf;
+    if (!thiz->m_pendingBuffers.take(buffer, buf)) {
         qWarning() << "Didn't remember returned buffer!?";
         return;
     }
@@ -295,14 +298,11 @@ void AndroidH264Encoder::onBufferReturned(MediaBufferWrapper *buffer, void *user
     // and reduce its reference count. It has an internal check if
     // an observer is still set or not before it will actually release
     // itself.
-    media_buffer_set_return_callback(iter->mediaBuffer, nullptr, nullptr);
+    media_buffer_set_return_callback(buffer, nullptr, nullptr);
 
     // Destroy the wrapper. Since this buffer is managed by us it will
     // be destroyed as intended in MediaBufferPrivate destructor.
-    media_buffer_destroy(iter->mediaBuffer);
-
-    auto buf = iter->buffer;
-    thiz->m_pendingBuffers.erase(iter);
+    media_buffer_destroy(buffer);
 
     // After we've cleaned up everything we can send the buffer
     // back to the producer which then can reuse it.
@@ -318,6 +318,7 @@ MediaBufferWrapper *AndroidH264Encoder::packBuffer(const Buffer::Ptr &inputBuffe
 {
     if (!inputBuffer->NativeHandle()) {
         qWarning() << "Ignoring buffer without native handle";
+        inputBuffer->Release();
         return nullptr;
     }
 
@@ -327,6 +328,8 @@ MediaBufferWrapper *AndroidH264Encoder::packBuffer(const Buffer::Ptr &inputBuffe
     // the ownership and release the memory once its destroyed.
     auto buffer = media_buffer_create(sizeof(VideoNativeMetadata));
     if (!buffer) {
+        qWarning() << "Failed to create a media buffer, dropping input";
+        inputBuffer->Release();
         return nullptr;
     }
 
@@ -337,6 +340,15 @@ MediaBufferWrapper *AndroidH264Encoder::packBuffer(const Buffer::Ptr &inputBuffe
     data->pBuffer = anwb;
     data->nFenceFd = -1;
 
+    // Waits for the codec to return an input if it already holds as many
+    // as we allow in flight.
+    if (!m_pendingBuffers.insert(buffer, inputBuffer)) {
+        qWarning() << "Too many buffers pending in the encoder, dropping input";
+        media_buffer_destroy(buffer);
+        inputBuffer->Release();
+        return nullptr;
+    }
+
     media_buffer_set_return_callback(buffer, &AndroidH264Encoder::onBufferReturned, this);
 
     // We need to put a reference on the buffer here if we want the
@@ -349,8 +361,6 @@ MediaBufferWrapper *AndroidH264Encoder::packBuffer(const Buffer::Ptr &inputBuffe
     media_meta_data_set_int64(meta, key_time, timestamp);
     media_meta_data_release(meta);
 
-    m_pendingBuffers.push_back(BufferItem{ inputBuffer, buffer });
-
     return buffer;
 }
 
@@ -384,6 +394,10 @@ void AndroidH264Encoder::start()
     }
     qDebug() << "encoder starting";
 
+    if (!startEncoder()) {
+        return;
+    }
+
     Q_EMIT started();
 }
 
@@ -392,42 +406,87 @@ void AndroidH264Encoder::stop()
     if (!m_encoder || !m_running) {
         return;
     }
+    qDebug() << "encoder stopping";
 
+    // Stopping makes any pending read in the drain thread return, the
+    // source refuses to hand out more input once we're not running.
+    m_running = false;
     if (!media_codec_source_stop(m_encoder)) {
-        return;
+        qWarning() << "failed to stop encoder";
     }
-    qDebug() << "encoder stopping";
 
-    m_running = false;
+    if (m_drainThread.joinable()) {
+        m_drainThread.join();
+    }
+
+    // Nothing reads from the queue anymore, hand what is left back
+    while (const auto buffer = m_inputQueue.pop()) {
+        buffer->Release();
+    }
+
+    const auto stats = m_inputQueue.stats();
+    qDebug() << "encoder input queue: pushes" << stats.pushes << "drops" << stats.drops
+             << "high water mark" << stats.highWaterMark << "waited"
+             << stats.popWait.count() << "us";
+
     Q_EMIT stopped();
 }
 
-void AndroidH264Encoder::addBuffer(const Buffer::Ptr &buffer)
+bool AndroidH264Encoder::startEncoder()
 {
-    m_inputQueue.push(buffer);
-    Q_EMIT receivedInputBuffer(buffer->Timestamp());
-    qDebug() << "encoder added buffer";
+    m_running = true;
 
-    if (!m_encoder || !m_running) {
-        m_running = true;
+    if (!media_codec_source_start(m_encoder)) {
+        qCritical() << "failed to start encoder";
+        m_running = false;
+        return false;
+    }
 
-        if (!media_codec_source_start(m_encoder)) {
-            qCritical() << "failed to start encoder";
-            m_running = false;
-            return;
+    m_drainThread = std::thread(&AndroidH264Encoder::drainOutput, this);
+    return true;
+}
+
+void AndroidH264Encoder::drainOutput()
+{
+    pthread_setname_np(pthread_self(), "encoder-drain");
+
+    while (m_running) {
+        MediaBufferWrapper *bufferWrapper = nullptr;
+        if (!media_codec_source_read(m_encoder, &bufferWrapper)) {
+            if (m_running) {
+                qCritical() << "failed to read a new buffer from encoder";
+            }
+            break;
         }
+
+        auto mbuf = MediaSourceBuffer::Create(bufferWrapper);
+
+        Q_EMIT finishedFrame(mbuf->Timestamp());
+
+        auto hasCodecConfig = AndroidH264Encoder::bufferHasCodecConfig(bufferWrapper);
+        Q_EMIT bufferAvailable(mbuf, hasCodecConfig);
     }
 
-    MediaBufferWrapper *bufferWrapper = nullptr;
-    if (!media_codec_source_read(m_encoder, &bufferWrapper)) {
-        qCritical() << "failed to read a new buffer from encoder";
+    qDebug() << "encoder drain finished";
+}
+
+void AndroidH264Encoder::addBuffer(const Buffer::Ptr &buffer)
+{
+    // The codec only runs between start() and stop(), a frame still queued
+    // for us after that is dropped instead of starting it again.
+    if (!m_encoder || !m_running) {
+        buffer->Release();
         return;
     }
 
-    auto mbuf = MediaSourceBuffer::Create(bufferWrapper);
-
-    Q_EMIT finishedFrame(mbuf->Timestamp());
+    // A buffer the queue drops has been released by it already
+    if (!m_inputQueue.push(buffer)) {
+        qWarning() << "encoder input queue is full, dropping buffer";
+        return;
+    }
+    Q_EMIT receivedInputBuffer(buffer->Timestamp());
+    qDebug() << "encoder added buffer";
 
-    auto hasCodecConfig = AndroidH264Encoder::bufferHasCodecConfig(bufferWrapper);
-    Q_EMIT bufferAvailable(mbuf, hasCodecConfig);
+    // The codec pulls its input through onSourceRead and the output is
+    // picked up by the drain thread, nothing else to do here.
 }
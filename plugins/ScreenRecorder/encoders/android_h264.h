@@ -2,14 +2,16 @@
 #define ENCODERS_ANDROID_H264_H
 
 #include <QObject>
-#include <QList>
+#include <atomic>
+#include <thread>
 #include <hybris/media/media_codec_source_layer.h>
 
 #include "encoder.h"
 #include "../hybris/media_message.h"
 #include "../hybris/media_meta_data.h"
 #include "../buffer.h"
-#include "../bufferqueue.h"
+#include "../slotmap.h"
+#include "../spscbufferqueue.h"
 
 class AndroidH264Encoder : public QObject, public Encoder
 {
@@ -82,18 +84,21 @@ public Q_SLOTS:
     void addBuffer(const Buffer::Ptr &buffer) override;
 
 private:
-    struct BufferItem
-    {
-        Buffer::Ptr buffer;
-        MediaBufferWrapper *mediaBuffer;
-    };
-
     std::unique_ptr<HybrisMediaMessage> m_format;
     std::unique_ptr<HybrisMediaMetaData> m_sourceFormat;
-    MediaCodecSourceWrapper *m_encoder;
-    QList<BufferItem> m_pendingBuffers;
-    BufferQueue m_inputQueue;
-    bool m_running = false;
+    MediaCodecSourceWrapper *m_encoder = nullptr;
+    // Input buffers handed to the codec, by the wrapper it gives back to
+    // onBufferReturned. Also bounds how many inputs the codec may hold.
+    SlotMap<MediaBufferWrapper *, Buffer::Ptr> m_pendingBuffers{ 8 };
+    // Under CPU pressure the stalest capture is dropped, not the latest one.
+    // Its capacity is the number of frames which can be in flight.
+    SpscBufferQueue m_inputQueue{ 4, SpscBufferQueue::OverflowPolicy::DropOldest };
+    // Pulls encoded buffers independently of input arrival
+    std::thread m_drainThread;
+    std::atomic<bool> m_running{ false };
+
+    bool startEncoder();
+    void drainOutput();
 
     static int onSourceRead(MediaBufferWrapper **buffer, void *user_data);
     static int onSourceStart(MediaMetaDataWrapper *meta, void *user_data);
@@ -101,6 +106,7 @@ private:
     static int onSourcePause(void *user_data);
     static void onBufferReturned(MediaBufferWrapper *buffer, void *user_data);
 
+    // Returns nullptr if the input was dropped, it is released already then
     MediaBufferWrapper *packBuffer(const Buffer::Ptr &inputBuffer, const int64_t &timestamp);
     static bool bufferHasCodecConfig(MediaBufferWrapper *buffer);
 };
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "avcodec_h264.h"
+#include "../colorconverter.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include <QDebug>
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+static constexpr const char *kPreferredEncoder{ "libx264" };
+static constexpr const char *kDefaultPreset{ "veryfast" };
+static constexpr int32_t kDefaultFramerate = 60;
+// Default is a bitrate of 8 MBit/s, software encoding can't keep up with
+// what the hardware encoders are configured for.
+static constexpr int32_t kDefaultBitrate = 8000000;
+// Timestamps are passed through in microseconds
+static constexpr AVRational kMicrosecondTimeBase{ 1, 1000000 };
+
+QString errorString(int error)
+{
+    char buffer[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+    av_strerror(error, buffer, sizeof(buffer));
+    return QString(buffer);
+}
+} // namespace
+
+AvcodecH264Encoder::AvcodecH264Encoder(QObject *parent) : QObject(parent)
+{
+}
+
+AvcodecH264Encoder::~AvcodecH264Encoder()
+{
+    stop();
+    release();
+}
+
+void AvcodecH264Encoder::configure(const Config &config)
+{
+    qDebug() << "configuring with" << config.width << "x" << config.height << "@"
+             << config.output_scale;
+
+    release();
+    m_config = config;
+
+    // 4:2:0 needs even dimensions
+    const int width = static_cast<int>(static_cast<float>(config.width) * config.output_scale) & ~1;
+    const int height = static_cast<int>(static_cast<float>(config.height) * config.output_scale) & ~1;
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("invalid encoder dimensions");
+    }
+
+    const AVCodec *codec = avcodec_find_encoder_by_name(kPreferredEncoder);
+    if (!codec) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    }
+    if (!codec) {
+        throw std::runtime_error("no H.264 encoder available in libavcodec");
+    }
+
+    m_context = avcodec_alloc_context3(codec);
+    if (!m_context) {
+        throw std::runtime_error("failed to allocate encoder context");
+    }
+
+    m_context->width = width;
+    m_context->height = height;
+    m_context->pix_fmt = AV_PIX_FMT_YUV420P;
+    m_context->time_base = kMicrosecondTimeBase;
+    m_context->framerate = AVRational{ config.framerate, 1 };
+    m_context->bit_rate = config.bitrate;
+    m_context->gop_size = config.framerate * std::max(config.i_frame_interval, 1u);
+    // The muxer writes samples in decode order without composition offsets
+    m_context->max_b_frames = 0;
+    m_context->thread_count = config.threads;
+
+    if (!config.preset.empty()) {
+        av_opt_set(m_context->priv_data, "preset", config.preset.c_str(), 0);
+    }
+    // Make requested key frames IDR frames so the stream can be cut there
+    av_opt_set(m_context->priv_data, "forced-idr", "1", 0);
+
+    const auto ret = avcodec_open2(m_context, codec, nullptr);
+    if (ret < 0) {
+        qCritical() << "failed to open encoder:" << errorString(ret);
+        release();
+        throw std::runtime_error("failed to open encoder");
+    }
+
+    m_frame = av_frame_alloc();
+    m_packet = av_packet_alloc();
+    if (!m_frame || !m_packet) {
+        release();
+        throw std::runtime_error("failed to allocate encoder frame");
+    }
+
+    m_frame->format = m_context->pix_fmt;
+    m_frame->width = width;
+    m_frame->height = height;
+    if (av_frame_get_buffer(m_frame, 0) < 0) {
+        release();
+        throw std::runtime_error("failed to allocate encoder frame buffer");
+    }
+
+    ColorConverter::Config conversion;
+    conversion.srcWidth = config.width;
+    conversion.srcHeight = config.height;
+    conversion.format = config.format;
+    conversion.dstWidth = width;
+    conversion.dstHeight = height;
+    conversion.layout = ColorConverter::Layout::I420;
+    conversion.threads = config.threads;
+    try {
+        m_converter.reset(new ColorConverter(conversion));
+    } catch (const std::runtime_error &) {
+        release();
+        throw;
+    }
+
+    qDebug() << "encoder" << codec->name << "configured succesfully";
+}
+
+AvcodecH264Encoder::Config AvcodecH264Encoder::defaultConfig()
+{
+    Config config;
+    config.framerate = kDefaultFramerate;
+    config.bitrate = kDefaultBitrate;
+    config.i_frame_interval = 1;
+    config.preset = kDefaultPreset;
+    return config;
+}
+
+void AvcodecH264Encoder::release()
+{
+    if (m_packet) {
+        av_packet_free(&m_packet);
+    }
+    if (m_frame) {
+        av_frame_free(&m_frame);
+    }
+    if (m_context) {
+        avcodec_free_context(&m_context);
+    }
+    m_converter.reset();
+    m_lastPts = -1;
+}
+
+void AvcodecH264Encoder::sendIDRFrame()
+{
+    m_forceIdr = true;
+}
+
+void AvcodecH264Encoder::start()
+{
+    if (!m_context || m_running) {
+        return;
+    }
+    qDebug() << "encoder starting";
+
+    m_running = true;
+    Q_EMIT started();
+}
+
+void AvcodecH264Encoder::stop()
+{
+    if (!m_context || !m_running) {
+        return;
+    }
+    qDebug() << "encoder stopping";
+
+    m_running = false;
+
+    // Drain whatever the encoder still holds, the context can't be fed
+    // anymore afterwards and has to be configured again.
+    encode(nullptr);
+
+    Q_EMIT stopped();
+}
+
+void AvcodecH264Encoder::addBuffer(const Buffer::Ptr &buffer)
+{
+    Q_EMIT receivedInputBuffer(buffer->Timestamp());
+
+    if (!m_running || !buffer->Data()) {
+        buffer->Release();
+        return;
+    }
+
+    const auto expected = m_config.width * m_config.height * bytesPerPixel(m_config.format);
+    if (buffer->Length() < expected) {
+        qWarning() << "Ignoring buffer with unexpected size" << buffer->Length();
+        buffer->Release();
+        return;
+    }
+
+    Q_EMIT beganFrame(buffer->Timestamp());
+
+    if (av_frame_make_writable(m_frame) < 0) {
+        qCritical() << "failed to make encoder frame writable";
+        buffer->Release();
+        return;
+    }
+
+    convert(buffer);
+
+    // libx264 refuses non increasing timestamps
+    m_lastPts = std::max(buffer->Timestamp(), m_lastPts + 1);
+    m_frame->pts = m_lastPts;
+    m_frame->pict_type = m_forceIdr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    m_forceIdr = false;
+
+    // The pixels have been copied into the encoder frame, so the producer
+    // can have its buffer back before the (slow) encode.
+    buffer->Release();
+    Q_EMIT bufferReturned();
+
+    encode(m_frame);
+}
+
+void AvcodecH264Encoder::convert(const Buffer::Ptr &input)
+{
+    ColorConverter::Planes planes;
+    for (int i = 0; i < 3; i++) {
+        planes.data[i] = m_frame->data[i];
+        planes.linesize[i] = m_frame->linesize[i];
+    }
+    m_converter->convert(input->Data(), planes);
+}
+
+bool AvcodecH264Encoder::encode(AVFrame *frame)
+{
+    auto ret = avcodec_send_frame(m_context, frame);
+    if (ret < 0) {
+        qCritical() << "avcodec_send_frame failed:" << errorString(ret);
+        return false;
+    }
+
+    for (;;) {
+        ret = avcodec_receive_packet(m_context, m_packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+        if (ret < 0) {
+            qCritical() << "avcodec_receive_packet failed:" << errorString(ret);
+            return false;
+        }
+
+        auto output = Buffer::Create(m_packet->data, m_packet->size);
+        output->SetTimestamp(m_packet->pts);
+        av_packet_unref(m_packet);
+
+        Q_EMIT finishedFrame(output->Timestamp());
+        // SPS/PPS are prepended to every key frame, like the hardware
+        // encoder does with prependSpsPpstoIdrFrames.
+        Q_EMIT bufferAvailable(output, false);
+    }
+}
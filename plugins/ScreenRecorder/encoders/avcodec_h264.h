@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ENCODERS_AVCODEC_H264_H
+#define ENCODERS_AVCODEC_H264_H
+
+#include <QObject>
+#include <memory>
+#include <string>
+
+#include "encoder.h"
+#include "../buffer.h"
+#include "../pixelformat.h"
+
+class ColorConverter;
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// CPU only H.264 encoder on top of libavcodec. Takes packed 32 bit RGB
+// frames as produced by CPU side captures and emits Annex-B access units
+// with in-band SPS/PPS on every key frame.
+class AvcodecH264Encoder : public QObject, public Encoder
+{
+    Q_OBJECT
+    Q_INTERFACES(Encoder)
+public:
+    class Config
+    {
+    public:
+        Config()
+            : width(0),
+              height(0),
+              output_scale(1.0f),
+              format(PixelFormat::RGBA8888),
+              bitrate(0),
+              framerate(0),
+              i_frame_interval(0),
+              threads(0)
+        {
+        }
+
+        unsigned int width;
+        unsigned int height;
+        float output_scale;
+        PixelFormat format;
+        unsigned int bitrate;
+        int framerate;
+        unsigned int i_frame_interval;
+        // x264 preset name, ignored by other encoders
+        std::string preset;
+        // 0 lets libavcodec decide, also used for the color conversion
+        int threads;
+    };
+
+    explicit AvcodecH264Encoder(QObject *parent = nullptr);
+    ~AvcodecH264Encoder();
+    void configure(const Config &config);
+    bool isRunning() const { return m_running; }
+    static AvcodecH264Encoder::Config defaultConfig();
+
+Q_SIGNALS:
+    void bufferAvailable(const Buffer::Ptr &buffer, const bool hasCodecConfig) override;
+    void bufferReturned() override;
+    void started() override;
+    void stopped() override;
+    void beganFrame(int64_t timestamp) override;
+    void finishedFrame(int64_t timestamp) override;
+    void receivedInputBuffer(int64_t timestamp) override;
+
+public Q_SLOTS:
+    void sendIDRFrame();
+    void start() override;
+    void stop() override;
+    void addBuffer(const Buffer::Ptr &buffer) override;
+
+private:
+    void convert(const Buffer::Ptr &input);
+    bool encode(AVFrame *frame);
+    void release();
+
+    Config m_config;
+    AVCodecContext *m_context = nullptr;
+    AVFrame *m_frame = nullptr;
+    AVPacket *m_packet = nullptr;
+    std::unique_ptr<ColorConverter> m_converter;
+    int64_t m_lastPts = -1;
+    bool m_forceIdr = false;
+    bool m_running = false;
+};
+
+#endif // ENCODERS_AVCODEC_H264_H
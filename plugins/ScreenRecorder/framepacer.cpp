@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "framepacer.h"
+
+#include <QDebug>
+#include <QSocketNotifier>
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+int64_t monotonicNanoseconds()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+} // namespace
+
+FramePacer::FramePacer(QObject *parent) : QObject(parent)
+{
+}
+
+FramePacer::~FramePacer()
+{
+    stop();
+}
+
+FramePacer::Stats FramePacer::stats() const
+{
+    std::lock_guard<std::mutex> l(m_statsMutex);
+    return m_stats;
+}
+
+void FramePacer::setFramerate(double framerate)
+{
+    if (framerate <= 0.0) {
+        qWarning() << "ignoring invalid frame rate" << framerate;
+        return;
+    }
+
+    // The upcoming deadline stays, the new rate counts from there
+    if (m_fd >= 0) {
+        m_base = deadline(m_frame);
+        m_frame = 0;
+    }
+    m_framerate = framerate;
+}
+
+void FramePacer::start()
+{
+    if (m_fd >= 0) {
+        return;
+    }
+
+    m_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_fd < 0) {
+        qCritical() << "failed to create frame timer:" << strerror(errno);
+        return;
+    }
+
+    m_notifier.reset(new QSocketNotifier(m_fd, QSocketNotifier::Read));
+    connect(m_notifier.data(), &QSocketNotifier::activated, this, &FramePacer::expired);
+
+    {
+        std::lock_guard<std::mutex> l(m_statsMutex);
+        m_stats = Stats();
+        m_totalJitter = 0;
+    }
+
+    // First frame right away
+    m_base = monotonicNanoseconds();
+    m_frame = 0;
+    arm(m_base);
+}
+
+void FramePacer::stop()
+{
+    if (m_fd < 0) {
+        return;
+    }
+
+    m_notifier.reset();
+    ::close(m_fd);
+    m_fd = -1;
+
+    const auto s = stats();
+    qDebug() << "frame pacing:" << s.frames << "frames," << s.missed << "missed, jitter mean"
+             << s.meanJitter << "us max" << s.maxJitter << "us";
+}
+
+int64_t FramePacer::deadline(int64_t frame) const
+{
+    return m_base + std::llround(frame * 1e9 / m_framerate);
+}
+
+bool FramePacer::arm(int64_t deadline)
+{
+    struct itimerspec spec;
+    ::memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000;
+    spec.it_value.tv_nsec = deadline % 1000000000;
+    if (::timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        qCritical() << "failed to arm frame timer:" << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void FramePacer::expired()
+{
+    uint64_t expirations = 0;
+    if (::read(m_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    const auto now = monotonicNanoseconds();
+    const auto lateness = std::max<int64_t>(now - deadline(m_frame), 0);
+
+    // Continue with the first deadline that's still ahead
+    int64_t next = m_frame + 1 + static_cast<int64_t>(lateness * m_framerate / 1e9);
+    while (deadline(next) <= now) {
+        next++;
+    }
+
+    {
+        std::lock_guard<std::mutex> l(m_statsMutex);
+        m_stats.frames++;
+        m_stats.missed += next - m_frame - 1;
+        m_totalJitter += lateness / 1000;
+        m_stats.meanJitter = m_totalJitter / static_cast<int64_t>(m_stats.frames);
+        m_stats.maxJitter = std::max(m_stats.maxJitter, lateness / 1000);
+    }
+
+    m_frame = next;
+    arm(deadline(m_frame));
+
+    Q_EMIT frameDue();
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <QObject>
+#include <QScopedPointer>
+#include <cstdint>
+#include <mutex>
+
+class QSocketNotifier;
+
+// Paces the capture from a timerfd on the thread the pacer lives on.
+// Deadlines are absolute, frame n is due at start + n / framerate, so
+// neither rounding nor late wakeups add up over a recording. Deadlines
+// which passed while the previous frame was still being captured are
+// skipped and counted instead of being served back to back.
+class FramePacer : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats
+    {
+        // Deadlines served
+        uint64_t frames = 0;
+        // Deadlines skipped
+        uint64_t missed = 0;
+        // Wakeup lateness against the deadline, in microseconds
+        int64_t meanJitter = 0;
+        int64_t maxJitter = 0;
+    };
+
+    explicit FramePacer(QObject *parent = nullptr);
+    ~FramePacer();
+
+    // May be called from any thread
+    Stats stats() const;
+
+Q_SIGNALS:
+    // Connect with Qt::DirectConnection to run on the pacing thread
+    void frameDue();
+
+public Q_SLOTS:
+    // Takes effect from the next deadline on
+    void setFramerate(double framerate);
+    void start();
+    void stop();
+
+private Q_SLOTS:
+    void expired();
+
+private:
+    int64_t deadline(int64_t frame) const;
+    bool arm(int64_t deadline);
+
+    int m_fd = -1;
+    QScopedPointer<QSocketNotifier> m_notifier;
+    double m_framerate = 60.0;
+    // CLOCK_MONOTONIC nanoseconds of frame zero of the current rate
+    int64_t m_base = 0;
+    int64_t m_frame = 0;
+
+    mutable std::mutex m_statsMutex;
+    Stats m_stats;
+    int64_t m_totalJitter = 0;
+};
+
+#endif // FRAMEPACER_H
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mediaclock.h"
+
+#include <time.h>
+
+MediaClock::Ptr MediaClock::create()
+{
+    return MediaClock::Ptr(new MediaClock());
+}
+
+int64_t MediaClock::monotonicTime()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void MediaClock::start()
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    m_origin = monotonicTime();
+    m_pausedAt = -1;
+}
+
+void MediaClock::pause()
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (m_origin < 0 || m_pausedAt >= 0)
+        return;
+    m_pausedAt = monotonicTime();
+}
+
+void MediaClock::resume()
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (m_pausedAt < 0)
+        return;
+    m_origin += monotonicTime() - m_pausedAt;
+    m_pausedAt = -1;
+}
+
+bool MediaClock::isStarted() const
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    return m_origin >= 0;
+}
+
+bool MediaClock::isPaused() const
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    return m_pausedAt >= 0;
+}
+
+int64_t MediaClock::now() const
+{
+    return toMediaTime(monotonicTime());
+}
+
+int64_t MediaClock::toMediaTime(int64_t monotonic) const
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (m_origin < 0)
+        return 0;
+    if (m_pausedAt >= 0 && monotonic > m_pausedAt)
+        monotonic = m_pausedAt;
+    return monotonic - m_origin;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MEDIACLOCK_H
+#define MEDIACLOCK_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "non_copyable.h"
+
+// Time base shared by everything that stamps buffers during a recording.
+// Media time is counted in microseconds on CLOCK_MONOTONIC from start(),
+// time spent paused is left out. All methods may be called from any
+// thread.
+class MediaClock : public NonCopyable
+{
+public:
+    typedef std::shared_ptr<MediaClock> Ptr;
+
+    static MediaClock::Ptr create();
+
+    // CLOCK_MONOTONIC in microseconds
+    static int64_t monotonicTime();
+
+    // Media time zero is now, a pause in progress ends
+    void start();
+    void pause();
+    void resume();
+
+    bool isStarted() const;
+    bool isPaused() const;
+
+    // Current media time, 0 before start() and frozen while paused
+    int64_t now() const;
+    // Media time of a monotonicTime() taken since the last resume()
+    int64_t toMediaTime(int64_t monotonic) const;
+
+private:
+    MediaClock() = default;
+
+    mutable std::mutex m_mutex;
+    // Monotonic time of media time zero, moved forward by every pause
+    int64_t m_origin = -1;
+    int64_t m_pausedAt = -1;
+};
+
+#endif // MEDIACLOCK_H
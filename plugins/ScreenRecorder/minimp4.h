@@ -269,6 +269,11 @@ typedef struct
     unsigned chunk_count;
     MP4D_file_offset_t *chunk_offset;
 
+    // Zero based numbers of the sync (key) samples in ascending order,
+    // NULL if the track has no sync sample table: then every sample is one
+    unsigned sync_sample_count;
+    unsigned *sync_sample;
+
 #if MP4D_TIMESTAMPS_SUPPORTED
     unsigned *timestamp;
     unsigned *duration;
@@ -337,6 +342,9 @@ typedef struct mp4_h26x_writer_tag
 {
 #if MINIMP4_TRANSCODE_SPS_ID
     h264_sps_id_patcher_t sps_patcher;
+    // Last SPS/PPS as received, repeated parameter sets are skipped
+    void *last_sps, *last_pps;
+    int last_sps_bytes, last_pps_bytes;
 #endif
     MP4E_mux_t *mux;
     int mux_track_id, is_hevc, need_vps, need_sps, need_pps, need_idr;
@@ -345,6 +353,11 @@ typedef struct mp4_h26x_writer_tag
 int mp4_h26x_write_init(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int height, int is_hevc);
 void mp4_h26x_write_close(mp4_h26x_writer_t *h);
 int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next);
+/**
+*   Same as mp4_h26x_write_nal() for a single NAL unit the caller already
+*   located, given without start code.
+*/
+int mp4_h26x_write_nal_unit(mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned timeStamp90kHz_next);
 
 /************************************************************************/
 /*          API                                                         */
@@ -372,6 +385,12 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 */
 MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample, unsigned int *frame_bytes, unsigned *timestamp, unsigned *duration);
 
+/**
+*   Return the last sync (key) sample at or before given sample, or the first
+*   sync sample of the track if there is none before it.
+*/
+unsigned MP4D_sync_sample_before(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample);
+
 /**
 *   De-allocated memory
 */
@@ -434,6 +453,46 @@ int MP4E_add_track(MP4E_mux_t *mux, const MP4E_track_t *track_data);
 */
 int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind);
 
+/**
+*   One piece of a sample passed to MP4E_put_sample_iov()
+*/
+typedef struct
+{
+    const void *data;
+    int bytes;
+} MP4E_iov_t;
+
+/**
+*   Same as MP4E_put_sample(), but the sample is gathered from iovcnt pieces.
+*   The pieces are written out in order without being copied together.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_put_sample_iov(MP4E_mux_t *mux, int track_num, const MP4E_iov_t *iov, int iovcnt, int duration, int kind);
+
+/**
+*   In fragmentation mode, start a new fragment once the pending one covers
+*   at least duration_ms milliseconds. A new fragment is always started at
+*   a video random access point, so with 0 (the default) every fragment
+*   holds one GOP.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_fragment_duration(MP4E_mux_t *mux, unsigned duration_ms);
+
+/**
+*   Group consecutive samples of a track into chunks of up to duration_ms
+*   milliseconds (1000 by default). Video chunks also start at each random
+*   access point. With several tracks, video samples are still written
+*   straight away while the samples of the other tracks are held back until
+*   their chunk is complete or a new video chunk starts, so tracks are
+*   interleaved chunk by chunk rather than sample by sample. 0 puts every
+*   sample into a chunk of its own. Has no effect in fragmentation mode.
+*
+*   return error code MP4E_STATUS_*
+*/
+int MP4E_set_chunk_duration(MP4E_mux_t *mux, unsigned duration_ms);
+
 /**
 *   Finalize MP4 file, de-allocated memory, and closes MP4 multiplexer.
 *   The close operation takes a time and disk space, since it writes MP4 file
@@ -673,6 +732,17 @@ typedef struct {
     int capacity;
 } minimp4_vector_t;
 
+// Index table which is moved out to a temporary file in blocks, so the
+// memory used for the index doesn't grow with the recording length
+#define MINIMP4_SPILL_BLOCK 16384
+
+typedef struct {
+    minimp4_vector_t mem;   // entries not spilled yet
+    FILE *file;             // created on first spill
+    long file_bytes;
+    int no_file;            // no temporary file available, keep everything in memory
+} minimp4_spill_t;
+
 typedef struct
 {
     MP4E_track_t info;
@@ -683,6 +753,32 @@ typedef struct
     minimp4_vector_t vpps;  // not used for audio
     minimp4_vector_t vvps;  // used for HEVC
 
+    // 'smpl' only holds the last sample, which may still grow or move.
+    // Once complete it goes to the index tables as ready-to-write entries.
+    minimp4_spill_t stts;   // (count, duration) runs
+    minimp4_spill_t stss;   // 1-based numbers of sync samples
+    minimp4_spill_t stsz;   // sample sizes
+    minimp4_spill_t stsc;   // (first_chunk, samples_per_chunk, 1) entries
+    minimp4_spill_t stco;   // 64-bit chunk offsets
+    unsigned samples_count;
+    unsigned sync_count;
+    unsigned stts_count;
+    unsigned run_count;     // samples in the current stts run
+    unsigned run_duration;
+    unsigned duration;      // sum of committed sample durations
+    boxsize_t last_offset;  // of the last chunk
+    unsigned chunk_count;
+    unsigned chunk_samples; // samples in the current chunk
+    unsigned chunk_duration;
+    boxsize_t chunk_end;    // file offset right after the current chunk
+    unsigned stsc_count;
+    unsigned stsc_samples;  // samples_per_chunk of the last stsc entry
+    unsigned pending_duration; // of the samples held back for the next chunk
+
+    // fragmentation mode: 'smpl' and 'pending_sample' only hold the samples
+    // of the current fragment
+    uint64_t fragment_decode_time; // sum of durations of all written fragments
+    unsigned fragment_duration;    // sum of durations in the current fragment
 } track_t;
 
 typedef struct MP4E_mux_tag
@@ -697,6 +793,8 @@ typedef struct MP4E_mux_tag
     int sequential_mode_flag;
     int enable_fragmentation; // flag, indicating streaming-friendly 'fragmentation' mode
     int fragments_count;      // # of fragments in 'fragmentation' mode
+    unsigned fragment_duration_ms; // minimal fragment length, 0 = one fragment per GOP
+    unsigned chunk_duration_ms;    // maximal chunk length, 0 = one sample per chunk
 
 } MP4E_mux_t;
 
@@ -803,6 +901,43 @@ static unsigned char *minimp4_vector_put(minimp4_vector_t *h, const void *buf, i
     return tail;
 }
 
+/**
+    Append entries to the table, spilling full blocks to a temporary file.
+    Return 1 on success, 0 on fail
+*/
+static int minimp4_spill_put(minimp4_spill_t *h, const void *buf, int bytes)
+{
+    if (!minimp4_vector_put(&h->mem, buf, bytes))
+        return 0;
+    if (h->mem.bytes < MINIMP4_SPILL_BLOCK || h->no_file)
+        return 1;
+    if (!h->file)
+        h->file = tmpfile();
+    if (h->file && fwrite(h->mem.data, 1, h->mem.bytes, h->file) == (size_t)h->mem.bytes)
+    {
+        h->file_bytes += h->mem.bytes;
+        h->mem.bytes = 0;
+    } else
+    {
+        // fall back to memory, anything past file_bytes is ignored
+        h->no_file = 1;
+    }
+    return 1;
+}
+
+static long minimp4_spill_bytes(const minimp4_spill_t *h)
+{
+    return h->file_bytes + h->mem.bytes;
+}
+
+static void minimp4_spill_reset(minimp4_spill_t *h)
+{
+    if (h->file)
+        fclose(h->file);
+    minimp4_vector_reset(&h->mem);
+    memset(h, 0, sizeof(minimp4_spill_t));
+}
+
 /**
 *   Allocates and initialize mp4 multiplexer
 *   return multiplexor handle on success; NULL on failure
@@ -818,6 +953,8 @@ MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *
     mux->sequential_mode_flag = sequential_mode_flag || enable_fragmentation;
     mux->enable_fragmentation = enable_fragmentation;
     mux->fragments_count = 0;
+    mux->fragment_duration_ms = 0;
+    mux->chunk_duration_ms = 1000;
     mux->write_callback = write_callback;
     mux->token = token;
     mux->text_comment = NULL;
@@ -933,13 +1070,180 @@ int MP4E_set_pps(MP4E_mux_t *mux, int track_id, const void *pps, int bytes)
 
 static unsigned get_duration(const track_t *tr)
 {
-    unsigned i, sum_duration = 0;
-    const sample_t *s = (const sample_t *)tr->smpl.data;
-    for (i = 0; i < tr->smpl.bytes/sizeof(sample_t); i++)
+    return tr->duration;
+}
+
+/**
+*   Whether the next sample has to start a new chunk, given the duration
+*   of the current one
+*/
+static int mp4e_chunk_full(const MP4E_mux_t *mux, const track_t *tr, unsigned chunk_duration, int random_access)
+{
+    if (!mux->chunk_duration_ms)
+        return 1;
+    if (random_access && tr->info.track_media_kind == e_video)
+        return 1;
+    return chunk_duration >= (uint64_t)mux->chunk_duration_ms*tr->info.time_scale/1000;
+}
+
+/**
+*   Add stsc entry for the current chunk, if its sample count differs
+*   from the previous one
+*/
+static int mp4e_close_chunk(track_t *tr)
+{
+    unsigned char base[12], *p = base;
+    if (!tr->chunk_samples || tr->chunk_samples == tr->stsc_samples)
+        return MP4E_STATUS_OK;
+    WRITE_4(tr->chunk_count);   // first_chunk
+    WRITE_4(tr->chunk_samples); // samples_per_chunk
+    WRITE_4(1);                 // sample_description_index
+    if (!minimp4_spill_put(&tr->stsc, base, p - base))
+        return MP4E_STATUS_NO_MEMORY;
+    tr->stsc_count++;
+    tr->stsc_samples = tr->chunk_samples;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Move the completed sample to the index tables
+*/
+static int mp4e_commit_sample(MP4E_mux_t *mux, track_t *tr, const sample_t *smp)
+{
+    unsigned char base[8], *p;
+
+    if (tr->run_count && smp->duration != tr->run_duration)
+    {
+        p = base;
+        WRITE_4(tr->run_count);
+        WRITE_4(tr->run_duration);
+        if (!minimp4_spill_put(&tr->stts, base, p - base))
+            return MP4E_STATUS_NO_MEMORY;
+        tr->stts_count++;
+        tr->run_count = 0;
+    }
+    tr->run_duration = smp->duration;
+    tr->run_count++;
+    tr->samples_count++;
+    tr->duration += smp->duration;
+
+    if (smp->flag_random_access)
+    {
+        p = base;
+        WRITE_4(tr->samples_count);
+        if (!minimp4_spill_put(&tr->stss, base, p - base))
+            return MP4E_STATUS_NO_MEMORY;
+        tr->sync_count++;
+    }
+
+    p = base;
+    WRITE_4(smp->size);
+    if (!minimp4_spill_put(&tr->stsz, base, p - base))
+        return MP4E_STATUS_NO_MEMORY;
+
+    // a sample which directly follows the current chunk in the file may join it
+    if (!tr->chunk_samples || smp->offset != tr->chunk_end ||
+        mp4e_chunk_full(mux, tr, tr->chunk_duration, smp->flag_random_access))
     {
-        sum_duration += s[i].duration;
+        ERR(mp4e_close_chunk(tr));
+        p = base;
+        WRITE_4((smp->offset >> 32) & 0xffffffff);
+        WRITE_4(smp->offset & 0xffffffff);
+        if (!minimp4_spill_put(&tr->stco, base, p - base))
+            return MP4E_STATUS_NO_MEMORY;
+        tr->last_offset = smp->offset;
+        tr->chunk_count++;
+        tr->chunk_samples = 0;
+        tr->chunk_duration = 0;
     }
-    return sum_duration;
+    tr->chunk_samples++;
+    tr->chunk_duration += smp->duration;
+    tr->chunk_end = smp->offset + smp->size;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Move all completed samples to the index tables
+*/
+static int mp4e_commit_pending(MP4E_mux_t *mux, track_t *tr)
+{
+    const sample_t *smpl = (const sample_t *)tr->smpl.data;
+    unsigned i, count = tr->smpl.bytes / sizeof(sample_t);
+    for (i = 0; i < count; i++)
+        ERR(mp4e_commit_sample(mux, tr, smpl + i));
+    tr->smpl.bytes = 0;
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Samples are held back for a whole chunk only if other tracks could
+*   otherwise write in between. Video is never copied, its chunks end
+*   where the held back chunks of the other tracks are written.
+*/
+static int mp4e_chunk_buffering(const MP4E_mux_t *mux, const track_t *tr)
+{
+    return !mux->sequential_mode_flag && mux->chunk_duration_ms &&
+        mux->tracks.bytes > (int)sizeof(track_t) && tr->info.track_media_kind != e_video;
+}
+
+/**
+*   Write out the samples held back for the current chunk
+*/
+static int mp4e_write_chunk(MP4E_mux_t *mux, track_t *tr)
+{
+    sample_t *smpl = (sample_t *)tr->smpl.data;
+    unsigned i, count = tr->smpl.bytes / sizeof(sample_t);
+    boxsize_t offset = (boxsize_t)mux->write_pos;
+
+    if (tr->pending_sample.bytes)
+    {
+        ERR(mux->write_callback(mux->write_pos, tr->pending_sample.data, tr->pending_sample.bytes, mux->token));
+        mux->write_pos += tr->pending_sample.bytes;
+    }
+    for (i = 0; i < count; i++)
+    {
+        smpl[i].offset = offset;
+        offset += smpl[i].size;
+    }
+    tr->pending_sample.bytes = 0;
+    tr->pending_duration = 0;
+    return mp4e_commit_pending(mux, tr);
+}
+
+/**
+*   Write out the held back chunks of all tracks, before a video sample
+*   which starts a new chunk
+*/
+static int mp4e_write_chunks(MP4E_mux_t *mux)
+{
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+        if (tr->smpl.bytes && mp4e_chunk_buffering(mux, tr))
+            ERR(mp4e_write_chunk(mux, tr));
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Commit the last samples and close the last stts run and chunk
+*/
+static int mp4e_commit_index(MP4E_mux_t *mux, track_t *tr)
+{
+    unsigned char base[8], *p = base;
+    ERR(mp4e_commit_pending(mux, tr));
+    ERR(mp4e_close_chunk(tr));
+    if (tr->run_count)
+    {
+        WRITE_4(tr->run_count);
+        WRITE_4(tr->run_duration);
+        if (!minimp4_spill_put(&tr->stts, base, p - base))
+            return MP4E_STATUS_NO_MEMORY;
+        tr->stts_count++;
+        tr->run_count = 0;
+    }
+    return MP4E_STATUS_OK;
 }
 
 static int write_pending_data(MP4E_mux_t *mux, track_t *tr)
@@ -988,98 +1292,116 @@ static int add_sample_descriptor(MP4E_mux_t *mux, track_t *tr, int data_bytes, i
 static int mp4e_flush_index(MP4E_mux_t *mux);
 
 /**
-*   Write Movie Fragment: 'moof' box
+*   Write Movie Fragment: 'moof' box with one 'traf' per track, followed by
+*   a single 'mdat' with the pending samples of all tracks
 */
-static int mp4e_write_fragment_header(MP4E_mux_t *mux, int track_num, int data_bytes, int duration, int kind
-#if MP4D_TFDT_SUPPORT
-, uint64_t timestamp
-#endif
-)
+static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size);
+
+static int mp4e_flush_fragment(MP4E_mux_t *mux)
 {
-    unsigned char base[888], *p = base;
+    unsigned char *base, *p;
     unsigned char *stack_base[20]; // atoms nesting stack
     unsigned char **stack = stack_base;
-    unsigned char *pdata_offset;
-    unsigned flags;
-    enum
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    unsigned moof_bytes = 8 + 16;   // moof + mfhd
+    unsigned data_bytes = 0, data_offset;
+    int i, err;
+
+    for (ntr = 0; ntr < ntracks; ntr++)
     {
-        default_sample_duration_present = 0x000008,
-        default_sample_flags_present = 0x000020,
-    } e;
+        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+        int samples_count = tr->smpl.bytes / sizeof(sample_t);
+        if (!samples_count)
+            continue;
+        // traf + tfhd + tfdt + trun header, then duration, size and (video only) flags per sample
+        moof_bytes += 8 + 16 + 20 + 20;
+        moof_bytes += samples_count * (tr->info.track_media_kind == e_video ? 12 : 8);
+        data_bytes += tr->pending_sample.bytes;
+    }
+    if (!data_bytes)
+        return MP4E_STATUS_OK;
 
-    track_t *tr = ((track_t*)mux->tracks.data) + track_num;
+    if (!mux->fragments_count)
+        ERR(mp4e_flush_index(mux)); // write file headers before 1st fragment
+    mux->fragments_count++;
 
+    base = (unsigned char*)malloc(moof_bytes);
+    if (!base)
+        return MP4E_STATUS_NO_MEMORY;
+    p = base;
+
+    // sample data of each track follows the mdat header in track order,
+    // trun data offsets are relative to the start of the moof
+    data_offset = moof_bytes + 8;
     ATOM(BOX_moof)
         ATOM_FULL(BOX_mfhd, 0)
             WRITE_4(mux->fragments_count);  // start from 1
         END_ATOM
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+        int samples_count = tr->smpl.bytes / sizeof(sample_t);
+        const sample_t *sample = (const sample_t *)tr->smpl.data;
+        int is_video = tr->info.track_media_kind == e_video;
+        unsigned flags;
+        if (!samples_count)
+            continue;
+
         ATOM(BOX_traf)
-            flags = 0;
-            if (tr->info.track_media_kind == e_video)
-                flags |= 0x20;          // default-sample-flags-present
-            else
-                flags |= 0x08;          // default-sample-duration-present
-            flags =  (tr->info.track_media_kind == e_video) ? 0x20020 : 0x20008;
-
-            ATOM_FULL(BOX_tfhd, flags)
-                WRITE_4(track_num + 1); // track_ID
-                if (tr->info.track_media_kind == e_video)
-                {
-                    WRITE_4(0x1010000); // default_sample_flags
-                } else
-                {
-                    WRITE_4(duration);
-                }
+            ATOM_FULL(BOX_tfhd, 0x020000)   // default-base-is-moof
+                WRITE_4(ntr + 1);           // track_ID
             END_ATOM
-            #if MP4D_TFDT_SUPPORT
             ATOM_FULL(BOX_tfdt, 0x01000000) // version 1
-                WRITE_4(timestamp >> 32); // upper timestamp
-                WRITE_4(timestamp & 0xffffffff); // lower timestamp
+                WRITE_4(tr->fragment_decode_time >> 32);
+                WRITE_4(tr->fragment_decode_time & 0xffffffff);
+            END_ATOM
+            flags  = 0;
+            flags |= 0x001;                 // data-offset-present
+            flags |= 0x100;                 // sample-duration-present
+            flags |= 0x200;                 // sample-size-present
+            if (is_video)
+                flags |= 0x400;             // sample-flags-present
+            ATOM_FULL(BOX_trun, flags)
+                WRITE_4(samples_count);
+                WRITE_4(data_offset);
+                for (i = 0; i < samples_count; i++)
+                {
+                    WRITE_4(sample[i].duration);
+                    WRITE_4(sample[i].size);
+                    if (is_video)
+                    {
+                        // sync sample, or non-sync sample depending on others
+                        WRITE_4(sample[i].flag_random_access ? 0x2000000 : 0x1010000);
+                    }
+                }
             END_ATOM
-            #endif
-            if (tr->info.track_media_kind == e_audio)
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;  // save ptr to data_offset
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            } else if (kind == MP4E_SAMPLE_RANDOM_ACCESS)
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
-                flags |= 0x004;         // first-sample-flags-present
-                flags |= 0x100;         // sample-duration-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;   // save ptr to data_offset
-                    WRITE_4(0x2000000); // first_sample_flags
-                    WRITE_4(duration);  // sample_duration
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            } else
-            {
-                flags  = 0;
-                flags |= 0x001;         // data-offset-present
-                flags |= 0x100;         // sample-duration-present
-                flags |= 0x200;         // sample-size-present
-                ATOM_FULL(BOX_trun, flags)
-                    WRITE_4(1);         // sample_count
-                    pdata_offset = p; p += 4;   // save ptr to data_offset
-                    WRITE_4(duration);  // sample_duration
-                    WRITE_4(data_bytes);// sample_size
-                END_ATOM
-            }
         END_ATOM
+        data_offset += tr->pending_sample.bytes;
+    }
     END_ATOM
-    WR4(pdata_offset, (p - base) + 8);
+    assert((unsigned)(p - base) == moof_bytes);
 
-    ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
-    mux->write_pos += p - base;
+    err = mux->write_callback(mux->write_pos, base, p - base, mux->token);
+    free(base);
+    if (err)
+        return err;
+    mux->write_pos += moof_bytes;
+
+    ERR(mp4e_write_mdat_box(mux, data_bytes + 8));
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t*)mux->tracks.data) + ntr;
+        if (tr->pending_sample.bytes)
+        {
+            ERR(mux->write_callback(mux->write_pos, tr->pending_sample.data, tr->pending_sample.bytes, mux->token));
+            mux->write_pos += tr->pending_sample.bytes;
+        }
+        // vectors keep their capacity, so memory use stays at one fragment
+        tr->fragment_decode_time += tr->fragment_duration;
+        tr->fragment_duration = 0;
+        tr->smpl.bytes = 0;
+        tr->pending_sample.bytes = 0;
+    }
     return MP4E_STATUS_OK;
 }
 
@@ -1096,31 +1418,78 @@ static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size)
 /**
 *   Add new sample to specified track
 */
-int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+static int mp4e_write_iov(MP4E_mux_t *mux, const MP4E_iov_t *iov, int iovcnt)
+{
+    int i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        ERR(mux->write_callback(mux->write_pos, iov[i].data, iov[i].bytes, mux->token));
+        mux->write_pos += iov[i].bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_put_sample_iov(MP4E_mux_t *mux, int track_num, const MP4E_iov_t *iov, int iovcnt, int duration, int kind)
 {
     track_t *tr;
-    if (!mux || !data)
+    int i, data_bytes = 0;
+    if (!mux || !iov || iovcnt <= 0)
         return MP4E_STATUS_BAD_ARGUMENTS;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (!iov[i].data || iov[i].bytes < 0)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+        data_bytes += iov[i].bytes;
+    }
     tr = ((track_t*)mux->tracks.data) + track_num;
 
     if (mux->enable_fragmentation)
     {
-        #if MP4D_TFDT_SUPPORT
-        // NOTE: assume a constant `duration` to calculate current timestamp
-        uint64_t timestamp = (uint64_t)mux->fragments_count * duration;
-        #endif
-        if (!mux->fragments_count++)
-            ERR(mp4e_flush_index(mux)); // write file headers before 1st sample
-        // write MOOF + MDAT + sample data
-        #if MP4D_TFDT_SUPPORT
-        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind, timestamp));
-        #else
-        ERR(mp4e_write_fragment_header(mux, track_num, data_bytes, duration, kind));
-        #endif
-        // write MDAT box for each sample
-        ERR(mp4e_write_mdat_box(mux, data_bytes + 8));
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
-        mux->write_pos += data_bytes;
+        if (kind != MP4E_SAMPLE_CONTINUATION)
+        {
+            // close the pending fragment at a key frame, or once it is long enough
+            int new_gop = kind == MP4E_SAMPLE_RANDOM_ACCESS && tr->info.track_media_kind == e_video;
+            int too_long = mux->fragment_duration_ms &&
+                tr->fragment_duration >= (uint64_t)mux->fragment_duration_ms*tr->info.time_scale/1000;
+            if (new_gop || too_long)
+                ERR(mp4e_flush_fragment(mux));
+            if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
+                return MP4E_STATUS_NO_MEMORY;
+            tr->fragment_duration += ((sample_t*)(tr->smpl.data + tr->smpl.bytes) - 1)->duration;
+        } else
+        {
+            if (tr->smpl.bytes < sizeof(sample_t))
+                return MP4E_STATUS_NO_MEMORY; // write continuation, but there are no samples in the fragment
+            ((sample_t*)(tr->smpl.data + tr->smpl.bytes) - 1)->size += data_bytes;
+        }
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (!minimp4_vector_put(&tr->pending_sample, iov[i].data, iov[i].bytes))
+                return MP4E_STATUS_NO_MEMORY;
+        }
+        return MP4E_STATUS_OK;
+    }
+
+    if (mp4e_chunk_buffering(mux, tr))
+    {
+        if (kind != MP4E_SAMPLE_CONTINUATION)
+        {
+            if (tr->smpl.bytes && mp4e_chunk_full(mux, tr, tr->pending_duration, kind == MP4E_SAMPLE_RANDOM_ACCESS))
+                ERR(mp4e_write_chunk(mux, tr));
+            if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
+                return MP4E_STATUS_NO_MEMORY;
+            tr->pending_duration += ((sample_t*)(tr->smpl.data + tr->smpl.bytes) - 1)->duration;
+        } else
+        {
+            if (tr->smpl.bytes < sizeof(sample_t))
+                return MP4E_STATUS_NO_MEMORY; // write continuation, but there are no samples in the chunk
+            ((sample_t*)(tr->smpl.data + tr->smpl.bytes) - 1)->size += data_bytes;
+        }
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (!minimp4_vector_put(&tr->pending_sample, iov[i].data, iov[i].bytes))
+                return MP4E_STATUS_NO_MEMORY;
+        }
         return MP4E_STATUS_OK;
     }
 
@@ -1128,6 +1497,11 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
     {
         if (mux->sequential_mode_flag)
             ERR(write_pending_data(mux, tr));
+        ERR(mp4e_commit_pending(mux, tr));  // previous sample is complete now
+        // the other tracks' chunks go in between video chunks
+        if (!mux->sequential_mode_flag && mux->chunk_duration_ms && tr->info.track_media_kind == e_video &&
+            (!tr->chunk_samples || mp4e_chunk_full(mux, tr, tr->chunk_duration, kind == MP4E_SAMPLE_RANDOM_ACCESS)))
+            ERR(mp4e_write_chunks(mux));
         if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
             return MP4E_STATUS_NO_MEMORY;
     } else
@@ -1145,16 +1519,28 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
 
     if (mux->sequential_mode_flag)
     {
-        if (!minimp4_vector_put(&tr->pending_sample, data, data_bytes))
-            return MP4E_STATUS_NO_MEMORY;
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (!minimp4_vector_put(&tr->pending_sample, iov[i].data, iov[i].bytes))
+                return MP4E_STATUS_NO_MEMORY;
+        }
     } else
     {
-        ERR(mux->write_callback(mux->write_pos, data, data_bytes, mux->token));
-        mux->write_pos += data_bytes;
+        ERR(mp4e_write_iov(mux, iov, iovcnt));
     }
     return MP4E_STATUS_OK;
 }
 
+int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+{
+    MP4E_iov_t iov;
+    if (!data)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    iov.data = data;
+    iov.bytes = data_bytes;
+    return MP4E_put_sample_iov(mux, track_num, &iov, 1, duration, kind);
+}
+
 /**
 *   calculate size of length field of OD box
 */
@@ -1172,6 +1558,22 @@ static int od_size_of_size(int size)
 *   http://atomicparsley.sourceforge.net/mpeg-4files.html
 *   note that ISO did not specify comment format.
 */
+int MP4E_set_fragment_duration(MP4E_mux_t *mux, unsigned duration_ms)
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->fragment_duration_ms = duration_ms;
+    return MP4E_STATUS_OK;
+}
+
+int MP4E_set_chunk_duration(MP4E_mux_t *mux, unsigned duration_ms)
+{
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->chunk_duration_ms = duration_ms;
+    return MP4E_STATUS_OK;
+}
+
 int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment)
 {
     if (!mux || !comment)
@@ -1185,15 +1587,73 @@ int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment)
 }
 
 /**
-*   Write file index 'moov' box with all its boxes and indexes
+*   Index table, which is streamed into the 'moov' box at 'pos'
+*/
+typedef struct
+{
+    unsigned char *pos;
+    minimp4_spill_t *table;
+    int narrow;                 // write only the lower 32 bits of 64-bit entries
+    unsigned char *atoms[20];   // enclosing atoms, their size must include the table
+    int depth;
+} mp4e_index_hole_t;
+
+static void mp4e_add_index_hole(mp4e_index_hole_t *hole, unsigned char *pos, unsigned char **stack_base, unsigned char **stack,
+    minimp4_spill_t *table, int narrow)
+{
+    hole->pos = pos;
+    hole->table = table;
+    hole->narrow = narrow;
+    hole->depth = stack - stack_base;
+    memcpy(hole->atoms, stack_base, hole->depth*sizeof(hole->atoms[0]));
+}
+
+static int mp4e_write_index_table(MP4E_mux_t *mux, minimp4_spill_t *h, int narrow)
+{
+    unsigned char buf[4096];
+    long pos = 0, total = minimp4_spill_bytes(h);
+    int i, bytes;
+
+    if (h->file && (fflush(h->file) || fseek(h->file, 0, SEEK_SET)))
+        return MP4E_STATUS_FILE_WRITE_ERROR;
+    while (pos < total)
+    {
+        if (pos < h->file_bytes)
+        {
+            bytes = (int)MINIMP4_MIN((long)sizeof(buf), h->file_bytes - pos);
+            if (fread(buf, 1, bytes, h->file) != (size_t)bytes)
+                return MP4E_STATUS_FILE_WRITE_ERROR;
+        } else
+        {
+            bytes = (int)MINIMP4_MIN((long)sizeof(buf), total - pos);
+            memcpy(buf, h->mem.data + (pos - h->file_bytes), bytes);
+        }
+        pos += bytes;
+        if (narrow)
+        {
+            for (i = 0; i < bytes/8; i++)
+                memmove(buf + 4*i, buf + 8*i + 4, 4);
+            bytes /= 2;
+        }
+        ERR(mux->write_callback(mux->write_pos, buf, bytes, mux->token));
+        mux->write_pos += bytes;
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+*   Write file index 'moov' box with all its boxes and indexes.
+*   The per-sample tables are not copied into memory, but streamed from
+*   the index tables in between the other boxes.
 */
 static int mp4e_flush_index(MP4E_mux_t *mux)
 {
     unsigned char *stack_base[20]; // atoms nesting stack
     unsigned char **stack = stack_base;
-    unsigned char *base, *p;
+    unsigned char *base, *p, *start;
     unsigned int ntr, index_bytes, ntracks = mux->tracks.bytes / sizeof(track_t);
-    int i, err;
+    mp4e_index_hole_t *holes;
+    int i, err, nholes = 0;
 
     // How much memory needed for indexes
     // Experimental data:
@@ -1210,17 +1670,30 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     {
         track_t *tr = ((track_t*)mux->tracks.data) + ntr;
         index_bytes += TRACK_HEADER_BYTES;          // fixed amount (implementation-dependent)
-        // may need extra 4 bytes for duration field + 4 bytes for worst-case random access box
-        index_bytes += tr->smpl.bytes * (sizeof(sample_t) + 4 + 4) / sizeof(sample_t);
         index_bytes += tr->vsps.bytes;
         index_bytes += tr->vpps.bytes;
 
-        ERR(write_pending_data(mux, tr));
+        if (!mux->enable_fragmentation)
+        {
+            if (mux->sequential_mode_flag)
+            {
+                ERR(write_pending_data(mux, tr));
+            } else if (mp4e_chunk_buffering(mux, tr))
+            {
+                ERR(mp4e_write_chunk(mux, tr));
+            }
+            ERR(mp4e_commit_index(mux, tr));
+        }
     }
 
     base = (unsigned char*)malloc(index_bytes);
-    if (!base)
+    holes = (mp4e_index_hole_t*)malloc((ntracks*5 + 1)*sizeof(mp4e_index_hole_t));
+    if (!base || !holes)
+    {
+        free(base);
+        free(holes);
         return MP4E_STATUS_NO_MEMORY;
+    }
     p = base;
 
     if (!mux->sequential_mode_flag)
@@ -1259,7 +1732,8 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
         if (ntracks)
         {
             track_t *tr = ((track_t*)mux->tracks.data) + 0;    // take 1st track
-            unsigned duration = get_duration(tr);
+            // the length of a fragmented file is only known from its fragments
+            unsigned duration = mux->enable_fragmentation ? 0 : get_duration(tr);
             duration = (unsigned)(duration * 1LL * MOOV_TIMESCALE / tr->info.time_scale);
             WRITE_4(MOOV_TIMESCALE); // duration
             WRITE_4(duration); // duration
@@ -1289,9 +1763,8 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
     for (ntr = 0; ntr < ntracks; ntr++)
     {
         track_t *tr = ((track_t*)mux->tracks.data) + ntr;
-        unsigned duration = get_duration(tr);
-        int samples_count = tr->smpl.bytes / sizeof(sample_t);
-        const sample_t *sample = (const sample_t *)tr->smpl.data;
+        unsigned duration = mux->enable_fragmentation ? 0 : get_duration(tr);
+        int samples_count = tr->samples_count;
         unsigned handler_type;
         const char *handler_ascii = NULL;
 
@@ -1587,36 +2060,14 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
 
                         // Time to Sample Box
                         ATOM_FULL(BOX_stts, 0);
-                        {
-                            unsigned char *pentry_count = p;
-                            int cnt = 1, entry_count = 0;
-                            WRITE_4(0);
-                            for (i = 0; i < samples_count; i++, cnt++)
-                            {
-                                if (i == (samples_count - 1) || sample[i].duration != sample[i + 1].duration)
-                                {
-                                    WRITE_4(cnt);
-                                    WRITE_4(sample[i].duration);
-                                    cnt = 0;
-                                    entry_count++;
-                                }
-                            }
-                            WR4(pentry_count, entry_count);
-                        }
+                        WRITE_4(tr->stts_count);
+                        mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stts, 0);
                         END_ATOM;
 
                         // Sample To Chunk Box
                         ATOM_FULL(BOX_stsc, 0);
-                        if (mux->enable_fragmentation)
-                        {
-                            WRITE_4(0); // entry_count
-                        } else
-                        {
-                            WRITE_4(1); // entry_count
-                            WRITE_4(1); // first_chunk;
-                            WRITE_4(1); // samples_per_chunk;
-                            WRITE_4(1); // sample_description_index;
-                        }
+                        WRITE_4(tr->stsc_count);
+                        mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stsc, 0);
                         END_ATOM;
 
                         // Sample Size Box
@@ -1624,57 +2075,31 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
                         WRITE_4(0); // sample_size  If this field is set to 0, then the samples have different sizes, and those sizes
                                     //  are stored in the sample size table.
                         WRITE_4(samples_count);  // sample_count;
-                        for (i = 0; i < samples_count; i++)
-                        {
-                            WRITE_4(sample[i].size);
-                        }
+                        mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stsz, 0);
                         END_ATOM;
 
                         // Chunk Offset Box
-                        int is_64_bit = 0;
-                        if (samples_count && sample[samples_count - 1].offset > 0xffffffff)
-                            is_64_bit = 1;
-                        if (!is_64_bit)
+                        if (tr->last_offset <= 0xffffffff)
                         {
                             ATOM_FULL(BOX_stco, 0);
-                            WRITE_4(samples_count);
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                WRITE_4(sample[i].offset);
-                            }
+                            WRITE_4(tr->chunk_count);
+                            mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stco, 1);
                         } else
                         {
                             ATOM_FULL(BOX_co64, 0);
-                            WRITE_4(samples_count);
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                WRITE_4((sample[i].offset >> 32) & 0xffffffff);
-                                WRITE_4(sample[i].offset & 0xffffffff);
-                            }
+                            WRITE_4(tr->chunk_count);
+                            mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stco, 0);
                         }
                         END_ATOM;
 
                         // Sync Sample Box
+                        if (tr->sync_count != tr->samples_count)
                         {
-                            int ra_count = 0;
-                            for (i = 0; i < samples_count; i++)
-                            {
-                                ra_count += !!sample[i].flag_random_access;
-                            }
-                            if (ra_count != samples_count)
-                            {
-                                // If the sync sample box is not present, every sample is a random access point.
-                                ATOM_FULL(BOX_stss, 0);
-                                WRITE_4(ra_count);
-                                for (i = 0; i < samples_count; i++)
-                                {
-                                    if (sample[i].flag_random_access)
-                                    {
-                                        WRITE_4(i + 1);
-                                    }
-                                }
-                                END_ATOM;
-                            }
+                            // If the sync sample box is not present, every sample is a random access point.
+                            ATOM_FULL(BOX_stss, 0);
+                            WRITE_4(tr->sync_count);
+                            mp4e_add_index_hole(holes + nholes++, p, stack_base, stack, &tr->stss, 0);
+                            END_ATOM;
                         }
                     END_ATOM;
                 END_ATOM;
@@ -1711,13 +2136,8 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
 
     if (mux->enable_fragmentation)
     {
-        track_t *tr = ((track_t*)mux->tracks.data) + 0;
-        uint32_t movie_duration = get_duration(tr);
-
+        // no 'mehd': the index is written before the first fragment
         ATOM(BOX_mvex);
-            ATOM_FULL(BOX_mehd, 0);
-                WRITE_4(movie_duration); // duration
-            END_ATOM;
         for (ntr = 0; ntr < ntracks; ntr++)
         {
             ATOM_FULL(BOX_trex, 0);
@@ -1734,8 +2154,34 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
 
     assert((unsigned)(p - base) <= index_bytes);
 
-    err = mux->write_callback(mux->write_pos, base, p - base, mux->token);
-    mux->write_pos += p - base;
+    // grow the enclosing atoms by the size of the tables
+    for (i = 0; i < nholes; i++)
+    {
+        long bytes = minimp4_spill_bytes(holes[i].table) >> holes[i].narrow;
+        int k;
+        for (k = 0; k < holes[i].depth; k++)
+        {
+            unsigned char *size = holes[i].atoms[k];
+            unsigned atom_bytes = ((unsigned)size[0] << 24) | (size[1] << 16) | (size[2] << 8) | size[3];
+            WR4(size, atom_bytes + bytes);
+        }
+    }
+
+    err = MP4E_STATUS_OK;
+    start = base;
+    for (i = 0; i <= nholes && !err; i++)
+    {
+        unsigned char *end = i < nholes ? holes[i].pos : p;
+        if (end > start)
+        {
+            err = mux->write_callback(mux->write_pos, start, end - start, mux->token);
+            mux->write_pos += end - start;
+        }
+        if (!err && i < nholes)
+            err = mp4e_write_index_table(mux, holes[i].table, holes[i].narrow);
+        start = end;
+    }
+    free(holes);
     free(base);
     return err;
 }
@@ -1748,6 +2194,12 @@ int MP4E_close(MP4E_mux_t *mux)
         return MP4E_STATUS_BAD_ARGUMENTS;
     if (!mux->enable_fragmentation)
         err = mp4e_flush_index(mux);
+    else
+    {
+        err = mp4e_flush_fragment(mux);
+        if (!err && !mux->fragments_count)
+            err = mp4e_flush_index(mux);    // nothing was recorded, still write a valid file
+    }
     if (mux->text_comment)
         free(mux->text_comment);
     ntracks = mux->tracks.bytes / sizeof(track_t);
@@ -1758,6 +2210,11 @@ int MP4E_close(MP4E_mux_t *mux)
         minimp4_vector_reset(&tr->vpps);
         minimp4_vector_reset(&tr->smpl);
         minimp4_vector_reset(&tr->pending_sample);
+        minimp4_spill_reset(&tr->stts);
+        minimp4_spill_reset(&tr->stss);
+        minimp4_spill_reset(&tr->stsz);
+        minimp4_spill_reset(&tr->stsc);
+        minimp4_spill_reset(&tr->stco);
     }
     minimp4_vector_reset(&mux->tracks);
     free(mux);
@@ -2254,6 +2711,8 @@ int mp4_h26x_write_init(mp4_h26x_writer_t *h, MP4E_mux_t *mux, int width, int he
     h->need_idr = 1;
 #if MINIMP4_TRANSCODE_SPS_ID
     memset(&h->sps_patcher, 0, sizeof(h264_sps_id_patcher_t));
+    h->last_sps = h->last_pps = NULL;
+    h->last_sps_bytes = h->last_pps_bytes = 0;
 #endif
     return MP4E_STATUS_OK;
 }
@@ -2273,6 +2732,10 @@ void mp4_h26x_write_close(mp4_h26x_writer_t *h)
         if (p->pps_cache[i])
             free(p->pps_cache[i]);
     }
+    if (h->last_sps)
+        free(h->last_sps);
+    if (h->last_pps)
+        free(h->last_pps);
 #endif
     memset(h, 0, sizeof(*h));
 }
@@ -2323,136 +2786,226 @@ static int mp4_h265_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, in
     return err;
 }
 
-int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next)
+/**
+*   Parse the start of a slice header from a small unescaped copy of the
+*   NAL prefix instead of unescaping the whole NAL.
+*   Return 1 if the slice refers to a PPS whose ID was remapped and
+*   needs to be transcoded.
+*/
+static int mp4_h26x_parse_slice_header(const mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned *first_mb_in_slice)
 {
-    const unsigned char *eof = nal + length;
-    int payload_type, sizeof_nal, err = MP4E_STATUS_OK;
-    for (;;nal++)
+    // The bit reader loads 16 bits at a time and may read ahead, the 0xFF
+    // padding also keeps ue_bits() from running off on garbage.
+    uint16_t prefix[24];
+    int payload_type = nal[0] & 31, bytes;
+    bit_reader_t bs[1];
+    memset(prefix, 0xFF, sizeof(prefix));
+    bytes = remove_nal_escapes((unsigned char *)prefix, nal + 1, MINIMP4_MIN(sizeof_nal - 1, 32));
+    init_bits(bs, prefix, bytes);
+    *first_mb_in_slice = ue_bits(bs);
+    if (payload_type != 1 && payload_type != 2 && payload_type != 5)
+        return 0;
+#if MINIMP4_TRANSCODE_SPS_ID
     {
+        unsigned pps_id;
+        if (!bytes)
+            return 1;
+        ue_bits(bs); // slice_type
+        pps_id = ue_bits(bs);
+        return pps_id >= MINIMP4_MAX_PPS || h->sps_patcher.map_pps[pps_id] != (int)pps_id;
+    }
+#else
+    (void)h;
+    return 0;
+#endif
+}
+
+/**
+*   Write a NAL as AVCC sample: the length prefix and the NAL itself are
+*   handed to the muxer separately, no copy is made.
+*/
+static int mp4_h26x_put_slice(mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned first_mb_in_slice, unsigned timeStamp90kHz_next)
+{
+    unsigned char size_prefix[4];
+    MP4E_iov_t iov[2];
+    int sample_kind = MP4E_SAMPLE_DEFAULT;
+    size_prefix[0] = (unsigned char)(sizeof_nal >> 24);
+    size_prefix[1] = (unsigned char)(sizeof_nal >> 16);
+    size_prefix[2] = (unsigned char)(sizeof_nal >>  8);
+    size_prefix[3] = (unsigned char)(sizeof_nal);
+    iov[0].data = size_prefix;
+    iov[0].bytes = 4;
+    iov[1].data = nal;
+    iov[1].bytes = sizeof_nal;
+    if (first_mb_in_slice)
+        sample_kind = MP4E_SAMPLE_CONTINUATION;
+    else if ((nal[0] & 31) == 5)
+        sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
+    return MP4E_put_sample_iov(h->mux, h->mux_track_id, iov, 2, timeStamp90kHz_next, sample_kind);
+}
+
 #if MINIMP4_TRANSCODE_SPS_ID
-        unsigned char *nal1, *nal2;
+/**
+*   Return 1 if the parameter set equals the last one of its kind, otherwise
+*   remember it and return 0.
+*/
+static int mp4_h26x_same_param_set(void **last, int *last_bytes, const unsigned char *nal, int sizeof_nal)
+{
+    if (*last && *last_bytes == sizeof_nal && !memcmp(*last, nal, sizeof_nal))
+        return 1;
+    if (*last)
+        free(*last);
+    *last = malloc(sizeof_nal);
+    *last_bytes = *last ? sizeof_nal : 0;
+    if (*last)
+        memcpy(*last, nal, sizeof_nal);
+    return 0;
+}
 #endif
-        nal = find_nal_unit(nal, (int)(eof - nal), &sizeof_nal);
-        if (!sizeof_nal)
-            break;
-        if (h->is_hevc)
-        {
-            ERR(mp4_h265_write_nal(h, nal, sizeof_nal, timeStamp90kHz_next));
-            continue;
-        }
-        payload_type = nal[0] & 31;
-        if (9 == payload_type)
-            continue;  // access unit delimiter, nothing to be done
+
+int mp4_h26x_write_nal_unit(mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned timeStamp90kHz_next)
+{
+    int payload_type, err = MP4E_STATUS_OK;
+    unsigned first_mb_in_slice;
 #if MINIMP4_TRANSCODE_SPS_ID
-        // Transcode SPS, PPS and slice headers, reassigning ID's for SPS and  PPS:
-        // - assign unique ID's to different SPS and PPS
-        // - assign same ID's to equal (except ID) SPS and PPS
-        // - save all different SPS and PPS
-        nal1 = (unsigned char *)malloc(sizeof_nal*17/16 + 32);
-        if (!nal1)
-            return MP4E_STATUS_NO_MEMORY;
-        nal2 = (unsigned char *)malloc(sizeof_nal*17/16 + 32);
-        if (!nal2)
-        {
-            free(nal1);
-            return MP4E_STATUS_NO_MEMORY;
-        }
-        sizeof_nal = remove_nal_escapes(nal2, nal, sizeof_nal);
-        if (!sizeof_nal)
-        {
-exit_with_free:
-            free(nal1);
-            free(nal2);
+    unsigned char *nal1, *nal2;
+#endif
+    if (h->is_hevc)
+        return mp4_h265_write_nal(h, nal, sizeof_nal, timeStamp90kHz_next);
+    payload_type = nal[0] & 31;
+    if (9 == payload_type)
+        return MP4E_STATUS_OK;  // access unit delimiter, nothing to be done
+    if (payload_type != 7 && payload_type != 8)
+    {
+        // Slices only need to be rewritten if their PPS got a new ID,
+        // otherwise the encoder's bytes go to the file as they are.
+        if (h->need_sps)
             return MP4E_STATUS_BAD_ARGUMENTS;
-        }
+        if (5 == payload_type)
+            h->need_idr = 0;
+        if (h->need_pps || h->need_idr)
+            return MP4E_STATUS_OK;
+        if (!mp4_h26x_parse_slice_header(h, nal, sizeof_nal, &first_mb_in_slice))
+            return mp4_h26x_put_slice(h, nal, sizeof_nal, first_mb_in_slice, timeStamp90kHz_next);
+    }
+#if MINIMP4_TRANSCODE_SPS_ID
+    // Encoders repeat their parameter sets in front of every IDR frame,
+    // those have been registered already.
+    if (7 == payload_type)
+    {
+        if (mp4_h26x_same_param_set(&h->last_sps, &h->last_sps_bytes, nal, sizeof_nal) && !h->need_sps)
+            return MP4E_STATUS_OK;
+        // A new SPS may change how the PPS has to be rewritten
+        h->last_pps_bytes = 0;
+    }
+    if (8 == payload_type && mp4_h26x_same_param_set(&h->last_pps, &h->last_pps_bytes, nal, sizeof_nal) && !h->need_pps)
+        return MP4E_STATUS_OK;
+    // Transcode SPS, PPS and slice headers, reassigning ID's for SPS and  PPS:
+    // - assign unique ID's to different SPS and PPS
+    // - assign same ID's to equal (except ID) SPS and PPS
+    // - save all different SPS and PPS
+    nal1 = (unsigned char *)malloc(sizeof_nal*17/16 + 32);
+    if (!nal1)
+        return MP4E_STATUS_NO_MEMORY;
+    nal2 = (unsigned char *)malloc(sizeof_nal*17/16 + 32);
+    if (!nal2)
+    {
+        free(nal1);
+        return MP4E_STATUS_NO_MEMORY;
+    }
+    sizeof_nal = remove_nal_escapes(nal2, nal, sizeof_nal);
+    if (!sizeof_nal)
+    {
+exit_with_free:
+        free(nal1);
+        free(nal2);
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    }
 
-        sizeof_nal = transcode_nalu(&h->sps_patcher, nal2, sizeof_nal, nal1);
-        sizeof_nal = nal_put_esc(nal2, nal1, sizeof_nal);
+    sizeof_nal = transcode_nalu(&h->sps_patcher, nal2, sizeof_nal, nal1);
+    sizeof_nal = nal_put_esc(nal2, nal1, sizeof_nal);
 
-        switch (payload_type) {
+    switch (payload_type) {
+    case 7:
+        MP4E_set_sps(h->mux, h->mux_track_id, nal2 + 4, sizeof_nal - 4);
+        h->need_sps = 0;
+        break;
+    case 8:
+        if (h->need_sps)
+            goto exit_with_free;
+        MP4E_set_pps(h->mux, h->mux_track_id, nal2 + 4, sizeof_nal - 4);
+        h->need_pps = 0;
+        break;
+    case 5:
+        if (h->need_sps)
+            goto exit_with_free;
+        h->need_idr = 0;
+        // flow through
+    default:
+        if (h->need_sps)
+            goto exit_with_free;
+        if (!h->need_pps && !h->need_idr)
+        {
+            bit_reader_t bs[1];
+            init_bits(bs, nal + 1, sizeof_nal - 4 - 1);
+            unsigned first_mb_in_slice = ue_bits(bs);
+            //unsigned slice_type = ue_bits(bs);
+            int sample_kind = MP4E_SAMPLE_DEFAULT;
+            nal2[0] = (unsigned char)((sizeof_nal - 4) >> 24);
+            nal2[1] = (unsigned char)((sizeof_nal - 4) >> 16);
+            nal2[2] = (unsigned char)((sizeof_nal - 4) >>  8);
+            nal2[3] = (unsigned char)((sizeof_nal - 4));
+            if (first_mb_in_slice)
+                sample_kind = MP4E_SAMPLE_CONTINUATION;
+            else if (payload_type == 5)
+                sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
+            err = MP4E_put_sample(h->mux, h->mux_track_id, nal2, sizeof_nal, timeStamp90kHz_next, sample_kind);
+        }
+        break;
+    }
+    free(nal1);
+    free(nal2);
+#else
+    // No SPS/PPS transcoding
+    // This branch assumes that encoder use correct SPS/PPS ID's
+    switch (payload_type) {
         case 7:
-            MP4E_set_sps(h->mux, h->mux_track_id, nal2 + 4, sizeof_nal - 4);
+            MP4E_set_sps(h->mux, h->mux_track_id, nal, sizeof_nal);
             h->need_sps = 0;
             break;
         case 8:
-            if (h->need_sps)
-                goto exit_with_free;
-            MP4E_set_pps(h->mux, h->mux_track_id, nal2 + 4, sizeof_nal - 4);
+            MP4E_set_pps(h->mux, h->mux_track_id, nal, sizeof_nal);
             h->need_pps = 0;
             break;
         case 5:
             if (h->need_sps)
-                goto exit_with_free;
+                return MP4E_STATUS_BAD_ARGUMENTS;
             h->need_idr = 0;
             // flow through
         default:
             if (h->need_sps)
-                goto exit_with_free;
+                return MP4E_STATUS_BAD_ARGUMENTS;
             if (!h->need_pps && !h->need_idr)
             {
-                bit_reader_t bs[1];
-                init_bits(bs, nal + 1, sizeof_nal - 4 - 1);
-                unsigned first_mb_in_slice = ue_bits(bs);
-                //unsigned slice_type = ue_bits(bs);
-                int sample_kind = MP4E_SAMPLE_DEFAULT;
-                nal2[0] = (unsigned char)((sizeof_nal - 4) >> 24);
-                nal2[1] = (unsigned char)((sizeof_nal - 4) >> 16);
-                nal2[2] = (unsigned char)((sizeof_nal - 4) >>  8);
-                nal2[3] = (unsigned char)((sizeof_nal - 4));
-                if (first_mb_in_slice)
-                    sample_kind = MP4E_SAMPLE_CONTINUATION;
-                else if (payload_type == 5)
-                    sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
-                err = MP4E_put_sample(h->mux, h->mux_track_id, nal2, sizeof_nal, timeStamp90kHz_next, sample_kind);
+                mp4_h26x_parse_slice_header(h, nal, sizeof_nal, &first_mb_in_slice);
+                err = mp4_h26x_put_slice(h, nal, sizeof_nal, first_mb_in_slice, timeStamp90kHz_next);
             }
             break;
-        }
-        free(nal1);
-        free(nal2);
-#else
-        // No SPS/PPS transcoding
-        // This branch assumes that encoder use correct SPS/PPS ID's
-        switch (payload_type) {
-            case 7:
-                MP4E_set_sps(h->mux, h->mux_track_id, nal, sizeof_nal);
-                h->need_sps = 0;
-                break;
-            case 8:
-                MP4E_set_pps(h->mux, h->mux_track_id, nal, sizeof_nal);
-                h->need_pps = 0;
-                break;
-            case 5:
-                if (h->need_sps)
-                    return MP4E_STATUS_BAD_ARGUMENTS;
-                h->need_idr = 0;
-                // flow through
-            default:
-                if (h->need_sps)
-                    return MP4E_STATUS_BAD_ARGUMENTS;
-                if (!h->need_pps && !h->need_idr)
-                {
-                    bit_reader_t bs[1];
-                    unsigned char *tmp = (unsigned char *)malloc(4 + sizeof_nal);
-                    if (!tmp)
-                        return MP4E_STATUS_NO_MEMORY;
-                    init_bits(bs, nal + 1, sizeof_nal - 1);
-                    unsigned first_mb_in_slice = ue_bits(bs);
-                    int sample_kind = MP4E_SAMPLE_DEFAULT;
-                    tmp[0] = (unsigned char)(sizeof_nal >> 24);
-                    tmp[1] = (unsigned char)(sizeof_nal >> 16);
-                    tmp[2] = (unsigned char)(sizeof_nal >>  8);
-                    tmp[3] = (unsigned char)(sizeof_nal);
-                    memcpy(tmp + 4, nal, sizeof_nal);
-                    if (first_mb_in_slice)
-                        sample_kind = MP4E_SAMPLE_CONTINUATION;
-                    else if (payload_type == 5)
-                        sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
-                    err = MP4E_put_sample(h->mux, h->mux_track_id, tmp, 4 + sizeof_nal, timeStamp90kHz_next, sample_kind);
-                    free(tmp);
-                }
-                break;
-        }
+    }
 #endif
+    return err;
+}
+
+int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int length, unsigned timeStamp90kHz_next)
+{
+    const unsigned char *eof = nal + length;
+    int sizeof_nal, err = MP4E_STATUS_OK;
+    for (;;nal++)
+    {
+        nal = find_nal_unit(nal, (int)(eof - nal), &sizeof_nal);
+        if (!sizeof_nal)
+            break;
+        err = mp4_h26x_write_nal_unit(h, nal, sizeof_nal, timeStamp90kHz_next);
         if (err)
             break;
     }
@@ -2614,6 +3167,7 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             {BOX_stsc, 0, 1},
             {BOX_stco, 0, 1},
             {BOX_co64, 0, 1},
+            {BOX_stss, 0, 1},
             {BOX_stsd, 0, 0},
             {BOX_esds, 0, 1}    // esds does not use track, but switches to OD mode. Check here, to avoid OD check
         };
@@ -2851,6 +3405,14 @@ broken_android_meta_hack:
                 SKIP(4);    // sample_description_index
             }
             break;
+        case BOX_stss:  //ISO/IEC 14496-12 Section 8.6.2 - Sync Sample Box.
+            tr->sync_sample_count = READ(4);
+            MALLOC(unsigned int*, tr->sync_sample, (tr->sync_sample_count + 1)*4);
+            for (i = 0; i < tr->sync_sample_count; i++)
+            {
+                tr->sync_sample[i] = READ(4) - 1;
+            }
+            break;
 #if MP4D_TRACE_TIMESTAMPS || MP4D_TIMESTAMPS_SUPPORTED
         case BOX_stts:
             {
@@ -3282,6 +3844,27 @@ MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned ntrack, u
     return offset;
 }
 
+// Exported API function
+unsigned MP4D_sync_sample_before(const MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample)
+{
+    const MP4D_track_t *tr = mp4->track + ntrack;
+    unsigned lo = 0, hi = tr->sync_sample_count;
+
+    if (!tr->sync_sample || !tr->sync_sample_count)
+        return nsample;
+
+    // First entry past nsample
+    while (lo < hi)
+    {
+        unsigned mid = lo + (hi - lo)/2;
+        if (tr->sync_sample[mid] <= nsample)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return tr->sync_sample[lo ? lo - 1 : 0];
+}
+
 #define FREE(x) if (x) {free(x); x = NULL;}
 
 // Exported API function
@@ -3297,6 +3880,7 @@ void MP4D_close(MP4D_demux_t *mp4)
 #endif
         FREE(tr->sample_to_chunk);
         FREE(tr->chunk_offset);
+        FREE(tr->sync_sample);
         FREE(tr->dsi);
     }
     FREE(mp4->track);
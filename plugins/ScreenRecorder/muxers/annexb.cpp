@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "annexb.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+// Each vector step looks at 16 bytes but can only confirm a start code
+// whose last byte is inside the block, so consecutive loads overlap.
+static constexpr size_t kBlockSize = 16;
+static constexpr size_t kBlockStep = kBlockSize - 2;
+
+const uint8_t *findStartCodeScalar(const uint8_t *p, const uint8_t *end)
+{
+    while (end - p >= 3) {
+        const auto zero = static_cast<const uint8_t *>(::memchr(p, 0, end - p - 2));
+        if (!zero)
+            break;
+        if (zero[1] == 0 && zero[2] == 1)
+            return zero;
+        p = zero + 1;
+    }
+    return end;
+}
+} // namespace
+
+const uint8_t *findStartCode(const uint8_t *begin, const uint8_t *end)
+{
+    const uint8_t *p = begin;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (static_cast<size_t>(end - p) >= kBlockSize) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const uint32_t zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        const uint32_t ones = _mm_movemask_epi8(_mm_cmpeq_epi8(v, one));
+        // Bit i set if p[i], p[i + 1] are zero and p[i + 2] is one
+        const uint32_t matches = zeros & (zeros >> 1) & (ones >> 2) & 0x3fff;
+        if (matches)
+            return p + __builtin_ctz(matches);
+        p += kBlockStep;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    while (static_cast<size_t>(end - p) >= kBlockSize) {
+        const uint8x16_t v = vld1q_u8(p);
+        // Narrow the comparison to 4 bits per byte to get a scalar mask
+        const uint64_t zeros = vget_lane_u64(
+                vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vceqq_u8(v, vdupq_n_u8(0))), 4)), 0);
+        const uint64_t ones = vget_lane_u64(
+                vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vceqq_u8(v, vdupq_n_u8(1))), 4)), 0);
+        const uint64_t matches = zeros & (zeros >> 4) & (ones >> 8) & 0x00ffffffffffffffull;
+        if (matches)
+            return p + __builtin_ctzll(matches) / 4;
+        p += kBlockStep;
+    }
+#endif
+
+    return findStartCodeScalar(p, end);
+}
+
+void splitNalUnits(const uint8_t *data, size_t size, std::vector<NalSpan> &nals)
+{
+    const uint8_t *end = data + size;
+    const uint8_t *start = findStartCode(data, end);
+
+    while (start != end) {
+        const uint8_t *payload = start + 3;
+        const uint8_t *next = findStartCode(payload, end);
+
+        // Drops the trailing_zero_8bits, which includes the leading zero of
+        // a four byte start code.
+        const uint8_t *stop = next;
+        while (stop > payload && stop[-1] == 0)
+            stop--;
+
+        if (stop > payload)
+            nals.push_back(NalSpan{ payload, static_cast<uint32_t>(stop - payload) });
+
+        start = next;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MUXERS_ANNEXB_H
+#define MUXERS_ANNEXB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A NAL unit inside an Annex-B byte stream, without its start code and
+// without the zero bytes trailing it.
+struct NalSpan
+{
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Returns the first 00 00 01 sequence in [begin, end), or end if there is
+// none. Uses SSE2 or NEON where available.
+const uint8_t *findStartCode(const uint8_t *begin, const uint8_t *end);
+
+// Splits an access unit into its NAL units in a single pass. Bytes in
+// front of the first start code are skipped. The spans point into data
+// and are appended to nals, which is not cleared first.
+void splitNalUnits(const uint8_t *data, size_t size, std::vector<NalSpan> &nals);
+
+#endif // MUXERS_ANNEXB_H
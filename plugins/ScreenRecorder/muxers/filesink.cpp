@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "filesink.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+// Matches the page size and the erase block granularity most eMMC and SD
+// controllers prefer.
+static constexpr size_t kStagingAlignment = 4096;
+
+uint8_t *allocateStaging(size_t size)
+{
+    void *staging = nullptr;
+    if (::posix_memalign(&staging, kStagingAlignment, size) != 0)
+        return nullptr;
+    return static_cast<uint8_t *>(staging);
+}
+} // namespace
+
+FileSink::FileSink(const Config &config) : m_config(config)
+{
+    m_config.stagingSize = std::max(config.stagingSize, kStagingAlignment);
+
+    m_staging = allocateStaging(m_config.stagingSize);
+    if (m_staging)
+        m_allStaging.push_back(m_staging);
+    else
+        qWarning() << "failed to allocate staging buffer, writing through";
+}
+
+FileSink::~FileSink()
+{
+    close();
+    for (auto staging : m_allStaging)
+        ::free(staging);
+}
+
+void FileSink::setBackPressureCallback(const std::function<void(bool)> &callback)
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    m_backPressure = callback;
+}
+
+bool FileSink::open(const QString &fileName)
+{
+    close();
+
+    m_fd = ::open(fileName.toLocal8Bit().constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (m_fd < 0) {
+        qCritical() << "failed to open" << fileName << ":" << ::strerror(errno);
+        return false;
+    }
+
+    m_stagingOffset = 0;
+    m_staged = 0;
+    m_stats = Stats();
+    m_failed = false;
+    m_stopping = false;
+    m_congested = false;
+    m_lastSync = std::chrono::steady_clock::now();
+
+    // Without a staging buffer there is nothing to hand over
+    if (isAsync() && m_staging)
+        m_thread = std::thread(&FileSink::run, this);
+
+    return true;
+}
+
+bool FileSink::close()
+{
+    if (m_fd < 0)
+        return true;
+
+    auto ok = submitStaged();
+
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> l(m_mutex);
+            m_stopping = true;
+        }
+        m_queued.notify_all();
+        m_thread.join();
+    }
+    ok = ok && !m_failed;
+
+    syncIfDue(true);
+
+    const auto stats = this->stats();
+    qDebug() << "wrote" << stats.bytes << "bytes from" << stats.writes << "writes in"
+             << stats.syscalls << "system calls, stalled for" << stats.stalled.count() << "us";
+
+    ::close(m_fd);
+    m_fd = -1;
+    return ok;
+}
+
+FileSink::Stats FileSink::stats()
+{
+    std::lock_guard<std::mutex> l(m_mutex);
+    return m_stats;
+}
+
+bool FileSink::writeAt(int64_t offset, const void *data, size_t size)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    uint64_t syscalls = 0;
+    bool ok = true;
+    while (size > 0) {
+        syscalls++;
+        const auto written = ::pwrite(m_fd, p, size, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            qCritical() << "failed to write to file:" << ::strerror(errno);
+            ok = false;
+            break;
+        }
+        p += written;
+        offset += written;
+        size -= written;
+    }
+
+    std::lock_guard<std::mutex> l(m_mutex);
+    m_stats.syscalls += syscalls;
+    return ok;
+}
+
+// Writes out the staging buffer followed by data, which continues right
+// where the staged bytes end, with a single system call where possible.
+bool FileSink::writeStagedAnd(const void *data, size_t size)
+{
+    struct iovec iov[2] = {
+        { m_staging, m_staged },
+        { const_cast<void *>(data), size },
+    };
+
+    const auto total = m_staged + size;
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_stats.syscalls++;
+    }
+    auto written = ::pwritev(m_fd, iov, 2, m_stagingOffset);
+    if (written < 0 && errno != EINTR) {
+        qCritical() << "failed to write to file:" << ::strerror(errno);
+        return false;
+    }
+    written = std::max<ssize_t>(written, 0);
+
+    // Short write, finish whatever is left piece by piece
+    bool ok = true;
+    if (static_cast<size_t>(written) < m_staged) {
+        ok = writeAt(m_stagingOffset + written, m_staging + written, m_staged - written)
+                && writeAt(m_stagingOffset + m_staged, data, size);
+    } else if (static_cast<size_t>(written) < total) {
+        const auto done = written - m_staged;
+        ok = writeAt(m_stagingOffset + written, static_cast<const uint8_t *>(data) + done,
+                     size - done);
+    }
+
+    m_stagingOffset += total;
+    m_staged = 0;
+    syncIfDue(false);
+    return ok;
+}
+
+bool FileSink::writeDirect(int64_t offset, const void *data, size_t size)
+{
+    if (!m_thread.joinable())
+        return writeAt(offset, data, size);
+
+    const auto p = static_cast<const uint8_t *>(data);
+    return submit(Block{ offset, nullptr, std::vector<uint8_t>(p, p + size), size });
+}
+
+// Copies data into staging buffers, handing each one off once it is full
+bool FileSink::stage(const void *data, size_t size)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        const auto n = std::min(size, m_config.stagingSize - m_staged);
+        ::memcpy(m_staging + m_staged, p, n);
+        m_staged += n;
+        p += n;
+        size -= n;
+
+        if (m_staged == m_config.stagingSize && !submitStaged())
+            return false;
+    }
+    return true;
+}
+
+bool FileSink::submitStaged()
+{
+    if (m_fd < 0 || m_staged == 0)
+        return true;
+
+    bool ok = true;
+    if (m_thread.joinable()) {
+        ok = submit(Block{ m_stagingOffset, m_staging, {}, m_staged });
+        m_staging = ok ? takeStagingBuffer() : nullptr;
+        if (!m_staging) {
+            m_failed = true;
+            ok = false;
+        }
+    } else {
+        ok = writeAt(m_stagingOffset, m_staging, m_staged);
+        syncIfDue(false);
+    }
+
+    m_stagingOffset += m_staged;
+    m_staged = 0;
+    m_stagedSince = std::chrono::steady_clock::now();
+    return ok;
+}
+
+bool FileSink::submit(Block &&block)
+{
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        if (m_failed)
+            return false;
+        m_queue.push_back(std::move(block));
+        m_stats.queueHighWaterMark =
+                std::max<uint32_t>(m_stats.queueHighWaterMark, m_queue.size());
+    }
+    m_queued.notify_one();
+    return true;
+}
+
+uint8_t *FileSink::takeStagingBuffer()
+{
+    std::unique_lock<std::mutex> l(m_mutex);
+
+    if (m_freeStaging.empty() && m_allStaging.size() <= m_config.queueDepth) {
+        if (auto staging = allocateStaging(m_config.stagingSize)) {
+            m_allStaging.push_back(staging);
+            return staging;
+        }
+    }
+
+    if (m_freeStaging.empty()) {
+        // Storage can't keep up, everything queued is still in flight
+        if (!m_congested) {
+            m_congested = true;
+            if (m_backPressure)
+                m_backPressure(true);
+        }
+
+        const auto waitStart = std::chrono::steady_clock::now();
+        m_drained.wait(l, [this]() { return !m_freeStaging.empty() || m_failed; });
+        m_stats.stalled += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - waitStart);
+    }
+
+    if (m_freeStaging.empty())
+        return nullptr;
+
+    const auto staging = m_freeStaging.back();
+    m_freeStaging.pop_back();
+    return staging;
+}
+
+void FileSink::syncIfDue(bool force)
+{
+    if (m_config.syncPolicy == SyncPolicy::Never)
+        return;
+
+    if (force) {
+        if (::fsync(m_fd) < 0)
+            qWarning() << "failed to sync file:" << ::strerror(errno);
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_config.syncPolicy == SyncPolicy::Periodic
+        && now - m_lastSync >= m_config.syncInterval) {
+        if (::fdatasync(m_fd) < 0)
+            qWarning() << "failed to sync file data:" << ::strerror(errno);
+        m_lastSync = now;
+    }
+}
+
+void FileSink::run()
+{
+    pthread_setname_np(pthread_self(), "mux-io");
+
+    std::unique_lock<std::mutex> l(m_mutex);
+    for (;;) {
+        m_queued.wait(l, [this]() { return !m_queue.empty() || m_stopping; });
+        if (m_queue.empty())
+            break;
+
+        auto block = std::move(m_queue.front());
+        m_queue.pop_front();
+        l.unlock();
+
+        const auto data = block.staging ? block.staging : block.patch.data();
+        if (!m_failed && !writeAt(block.offset, data, block.size))
+            m_failed = true;
+        syncIfDue(false);
+
+        l.lock();
+        if (block.staging)
+            m_freeStaging.push_back(block.staging);
+        if (m_congested && m_queue.size() <= m_config.queueDepth / 2) {
+            m_congested = false;
+            if (m_backPressure)
+                m_backPressure(false);
+        }
+        m_drained.notify_all();
+    }
+}
+
+bool FileSink::write(int64_t offset, const void *data, size_t size)
+{
+    if (m_fd < 0 || m_failed)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_stats.writes++;
+        m_stats.bytes += size;
+    }
+
+    if (!m_staging)
+        return writeDirect(offset, data, size);
+
+    const auto stagedEnd = m_stagingOffset + static_cast<int64_t>(m_staged);
+
+    // Patch of bytes which are still staged
+    if (offset >= m_stagingOffset && offset + static_cast<int64_t>(size) <= stagedEnd) {
+        ::memcpy(m_staging + (offset - m_stagingOffset), data, size);
+        return true;
+    }
+
+    // Anything which doesn't continue the staged data: write out what we
+    // have and start over at the new position.
+    if (m_staged > 0 && offset != stagedEnd) {
+        if (!submitStaged())
+            return false;
+        // Patches of already written data are rare and small, don't let
+        // them start a new staging run.
+        if (offset < m_stagingOffset)
+            return writeDirect(offset, data, size);
+    }
+
+    if (m_staged == 0) {
+        m_stagingOffset = offset;
+        m_stagedSince = std::chrono::steady_clock::now();
+    }
+
+    if (m_staged + size > m_config.stagingSize) {
+        if (m_thread.joinable())
+            return stage(data, size);
+        return writeStagedAnd(data, size);
+    }
+
+    ::memcpy(m_staging + m_staged, data, size);
+    m_staged += size;
+
+    if (m_staged == m_config.stagingSize
+        || std::chrono::steady_clock::now() - m_stagedSince >= m_config.flushInterval)
+        return submitStaged();
+
+    return true;
+}
+
+bool FileSink::flush()
+{
+    return submitStaged();
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MUXERS_FILESINK_H
+#define MUXERS_FILESINK_H
+
+#include <QString>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../non_copyable.h"
+
+// Write-behind file output for the muxer. Writes which continue where the
+// previous one ended are collected in an aligned staging buffer and reach
+// the file in large blocks; writes elsewhere (patching a box size) go out
+// with pwrite() right away, or are applied to the staging buffer if they
+// land inside it.
+//
+// With a queue depth set, full staging buffers are handed to an I/O thread
+// instead of being written by the caller. Patches are queued as well so
+// everything reaches the file in the order it was written.
+class FileSink : public NonCopyable
+{
+public:
+    static constexpr size_t kDefaultStagingSize = 4 * 1024 * 1024;
+
+    enum class SyncPolicy {
+        // Leave it to the kernel
+        Never,
+        // fsync() once the file is closed
+        OnClose,
+        // fdatasync() every sync interval and fsync() on close
+        Periodic,
+    };
+
+    class Config
+    {
+    public:
+        Config()
+            : stagingSize(kDefaultStagingSize),
+              flushInterval(1000),
+              queueDepth(0),
+              syncPolicy(SyncPolicy::OnClose),
+              syncInterval(5000)
+        {
+        }
+
+        // Staged data is written out once stagingSize bytes have collected
+        // or the oldest of it is older than flushInterval.
+        size_t stagingSize;
+        std::chrono::milliseconds flushInterval;
+        // Staging buffers which may wait for the I/O thread, 0 writes on
+        // the calling thread.
+        uint32_t queueDepth;
+        SyncPolicy syncPolicy;
+        std::chrono::milliseconds syncInterval;
+    };
+
+    struct Stats
+    {
+        uint64_t bytes = 0;
+        uint64_t writes = 0;
+        uint64_t syscalls = 0;
+        uint32_t queueHighWaterMark = 0;
+        // Time writers spent waiting for the I/O thread
+        std::chrono::microseconds stalled{ 0 };
+    };
+
+    explicit FileSink(const Config &config = Config());
+    ~FileSink();
+
+    bool open(const QString &fileName);
+    bool write(int64_t offset, const void *data, size_t size);
+    bool flush();
+    bool close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    Stats stats();
+
+    // Called with true when a write has to wait for the I/O thread and
+    // with false once its queue has drained again. Runs on either thread.
+    void setBackPressureCallback(const std::function<void(bool)> &callback);
+
+private:
+    struct Block
+    {
+        int64_t offset;
+        // Either a staging buffer which goes back to the free list or a
+        // copy of a patch.
+        uint8_t *staging;
+        std::vector<uint8_t> patch;
+        size_t size;
+    };
+
+    bool writeAt(int64_t offset, const void *data, size_t size);
+    bool writeStagedAnd(const void *data, size_t size);
+    bool writeDirect(int64_t offset, const void *data, size_t size);
+    bool stage(const void *data, size_t size);
+    bool submitStaged();
+    bool submit(Block &&block);
+    uint8_t *takeStagingBuffer();
+    void syncIfDue(bool force);
+    void run();
+    bool isAsync() const { return m_config.queueDepth > 0; }
+
+    Config m_config;
+    uint8_t *m_staging = nullptr;
+    // File offset of the first staged byte
+    int64_t m_stagingOffset = 0;
+    size_t m_staged = 0;
+    std::chrono::steady_clock::time_point m_stagedSince;
+    int m_fd = -1;
+    Stats m_stats;
+
+    // I/O thread
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_queued;
+    std::condition_variable m_drained;
+    std::deque<Block> m_queue;
+    std::vector<uint8_t *> m_freeStaging;
+    std::vector<uint8_t *> m_allStaging;
+    std::function<void(bool)> m_backPressure;
+    std::chrono::steady_clock::time_point m_lastSync;
+    bool m_congested = false;
+    bool m_stopping = false;
+    std::atomic<bool> m_failed{ false };
+};
+
+#endif // MUXERS_FILESINK_H
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "gop_reencoder.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+}
+
+#include <QDebug>
+#include <QString>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "annexb.h"
+
+namespace {
+// Only x264 lets us pick the parameter set ids
+static constexpr const char *kEncoder{ "libx264" };
+static constexpr const char *kPreset{ "veryfast" };
+
+QString errorString(int error)
+{
+    char buffer[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+    av_strerror(error, buffer, sizeof(buffer));
+    return QString(buffer);
+}
+
+void putBigEndian(std::vector<uint8_t> &out, uint32_t value, int bytes)
+{
+    while (bytes--)
+        out.push_back(static_cast<uint8_t>(value >> (bytes * 8)));
+}
+
+// AVCDecoderConfigurationRecord with 4 byte NAL lengths
+std::vector<uint8_t> decoderConfig(const std::vector<std::vector<uint8_t>> &sps,
+                                   const std::vector<std::vector<uint8_t>> &pps)
+{
+    const auto &first = sps.front();
+    std::vector<uint8_t> config{ 1, first.size() > 1 ? first[1] : uint8_t(0),
+                                 first.size() > 2 ? first[2] : uint8_t(0),
+                                 first.size() > 3 ? first[3] : uint8_t(0), 0xff };
+    config.push_back(static_cast<uint8_t>(0xe0 | sps.size()));
+    for (const auto &nal : sps) {
+        putBigEndian(config, nal.size(), 2);
+        config.insert(config.end(), nal.begin(), nal.end());
+    }
+    config.push_back(static_cast<uint8_t>(pps.size()));
+    for (const auto &nal : pps) {
+        putBigEndian(config, nal.size(), 2);
+        config.insert(config.end(), nal.begin(), nal.end());
+    }
+    return config;
+}
+
+void addUnique(std::vector<std::vector<uint8_t>> &sets, const NalSpan &nal)
+{
+    std::vector<uint8_t> set(nal.data, nal.data + nal.size);
+    if (std::find(sets.begin(), sets.end(), set) == sets.end())
+        sets.push_back(std::move(set));
+}
+} // namespace
+
+GopReencoder::GopReencoder()
+{
+}
+
+GopReencoder::~GopReencoder()
+{
+    release();
+}
+
+void GopReencoder::configure(const Config &config)
+{
+    release();
+    m_config = config;
+    m_samples.clear();
+    m_sps.clear();
+    m_pps.clear();
+    m_idrSent = false;
+
+    if (config.sps.empty() || config.pps.empty() || !config.timescale) {
+        throw std::runtime_error("incomplete source stream configuration");
+    }
+
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        throw std::runtime_error("no H.264 decoder available in libavcodec");
+    }
+
+    m_decoder = avcodec_alloc_context3(codec);
+    if (!m_decoder) {
+        throw std::runtime_error("failed to allocate decoder context");
+    }
+
+    const auto extradata = decoderConfig(config.sps, config.pps);
+    m_decoder->extradata =
+            static_cast<uint8_t *>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!m_decoder->extradata) {
+        release();
+        throw std::runtime_error("failed to allocate decoder configuration");
+    }
+    std::memcpy(m_decoder->extradata, extradata.data(), extradata.size());
+    m_decoder->extradata_size = static_cast<int>(extradata.size());
+    m_decoder->width = config.width;
+    m_decoder->height = config.height;
+    m_decoder->pkt_timebase = AVRational{ 1, static_cast<int>(config.timescale) };
+
+    const auto ret = avcodec_open2(m_decoder, codec, nullptr);
+    if (ret < 0) {
+        qCritical() << "failed to open decoder:" << errorString(ret);
+        release();
+        throw std::runtime_error("failed to open decoder");
+    }
+
+    m_frame = av_frame_alloc();
+    m_input = av_packet_alloc();
+    m_output = av_packet_alloc();
+    if (!m_frame || !m_input || !m_output) {
+        release();
+        throw std::runtime_error("failed to allocate codec buffers");
+    }
+}
+
+void GopReencoder::release()
+{
+    if (m_output) {
+        av_packet_free(&m_output);
+    }
+    if (m_input) {
+        av_packet_free(&m_input);
+    }
+    if (m_frame) {
+        av_frame_free(&m_frame);
+    }
+    if (m_encoder) {
+        avcodec_free_context(&m_encoder);
+    }
+    if (m_decoder) {
+        avcodec_free_context(&m_decoder);
+    }
+}
+
+bool GopReencoder::addSample(const uint8_t *data, size_t size, int64_t timestamp)
+{
+    if (!m_decoder) {
+        return false;
+    }
+
+    if (av_new_packet(m_input, static_cast<int>(size)) < 0) {
+        qCritical() << "failed to allocate decoder packet";
+        return false;
+    }
+    std::memcpy(m_input->data, data, size);
+    m_input->pts = timestamp;
+    m_input->dts = timestamp;
+
+    const auto ok = decode(m_input);
+    av_packet_unref(m_input);
+    return ok;
+}
+
+bool GopReencoder::finish()
+{
+    if (!m_decoder || !decode(nullptr)) {
+        return false;
+    }
+    return !m_encoder || encode(nullptr);
+}
+
+bool GopReencoder::decode(const AVPacket *packet)
+{
+    auto ret = avcodec_send_packet(m_decoder, packet);
+    if (ret < 0) {
+        qCritical() << "avcodec_send_packet failed:" << errorString(ret);
+        return false;
+    }
+
+    for (;;) {
+        ret = avcodec_receive_frame(m_decoder, m_frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+        if (ret < 0) {
+            qCritical() << "avcodec_receive_frame failed:" << errorString(ret);
+            return false;
+        }
+
+        // Frames in front of the cut are only needed as references
+        const auto pts = m_frame->best_effort_timestamp;
+        const bool ok = pts < m_config.keepFrom || encode(m_frame);
+        av_frame_unref(m_frame);
+        if (!ok) {
+            return false;
+        }
+    }
+}
+
+bool GopReencoder::openEncoder(const AVFrame *frame)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(kEncoder);
+    if (!codec) {
+        qCritical() << "no" << kEncoder << "encoder available in libavcodec";
+        return false;
+    }
+
+    m_encoder = avcodec_alloc_context3(codec);
+    if (!m_encoder) {
+        qCritical() << "failed to allocate encoder context";
+        return false;
+    }
+
+    m_encoder->width = frame->width;
+    m_encoder->height = frame->height;
+    m_encoder->pix_fmt = static_cast<AVPixelFormat>(frame->format);
+    m_encoder->color_range = frame->color_range;
+    m_encoder->time_base = AVRational{ 1, static_cast<int>(m_config.timescale) };
+    m_encoder->framerate = AVRational{ std::max(m_config.framerate, 1), 1 };
+    m_encoder->bit_rate = m_config.bitrate;
+    // Everything after the first frame refers back to it, the next key
+    // frame is the one of the following untouched group of pictures.
+    m_encoder->gop_size = std::numeric_limits<int>::max();
+    m_encoder->max_b_frames = 0;
+
+    av_opt_set(m_encoder->priv_data, "preset", kPreset, 0);
+    av_opt_set(m_encoder->priv_data, "forced-idr", "1", 0);
+    const auto params = std::string("sps-id=") + std::to_string(m_config.parameterSetId);
+    av_opt_set(m_encoder->priv_data, "x264-params", params.c_str(), 0);
+
+    const auto ret = avcodec_open2(m_encoder, codec, nullptr);
+    if (ret < 0) {
+        qCritical() << "failed to open encoder:" << errorString(ret);
+        avcodec_free_context(&m_encoder);
+        return false;
+    }
+    return true;
+}
+
+bool GopReencoder::encode(AVFrame *frame)
+{
+    if (frame) {
+        if (!m_encoder && !openEncoder(frame)) {
+            return false;
+        }
+        frame->pts = frame->best_effort_timestamp;
+        frame->pict_type = m_idrSent ? AV_PICTURE_TYPE_NONE : AV_PICTURE_TYPE_I;
+        m_idrSent = true;
+    }
+
+    auto ret = avcodec_send_frame(m_encoder, frame);
+    if (ret < 0) {
+        qCritical() << "avcodec_send_frame failed:" << errorString(ret);
+        return false;
+    }
+
+    std::vector<NalSpan> nals;
+    for (;;) {
+        ret = avcodec_receive_packet(m_encoder, m_output);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+        if (ret < 0) {
+            qCritical() << "avcodec_receive_packet failed:" << errorString(ret);
+            return false;
+        }
+
+        Sample sample;
+        sample.timestamp = m_output->pts;
+        sample.keyFrame = m_output->flags & AV_PKT_FLAG_KEY;
+
+        // Annex-B to length prefixed. SPS and PPS stay in band as well,
+        // players which only read them from the sample description find
+        // them there too.
+        nals.clear();
+        splitNalUnits(m_output->data, m_output->size, nals);
+        for (const auto &nal : nals) {
+            const auto type = nal.size ? nal.data[0] & 0x1f : 0;
+            if (!nal.size || type == 9) {
+                continue;
+            }
+            if (type == 7) {
+                addUnique(m_sps, nal);
+            } else if (type == 8) {
+                addUnique(m_pps, nal);
+            }
+            putBigEndian(sample.data, nal.size, 4);
+            sample.data.insert(sample.data.end(), nal.data, nal.data + nal.size);
+        }
+        av_packet_unref(m_output);
+
+        m_samples.push_back(std::move(sample));
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MUXERS_GOP_REENCODER_H
+#define MUXERS_GOP_REENCODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "../non_copyable.h"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// Re-encodes part of a group of pictures, for cuts which don't start on a
+// key frame. The samples are decoded starting at the key frame before the
+// cut, the frames from the cut on go through libx264 again and the first
+// of them becomes an IDR frame.
+//
+// The new samples use their own SPS/PPS id, so they can share a track
+// with the untouched samples following them.
+class GopReencoder : public NonCopyable
+{
+public:
+    class Config
+    {
+    public:
+        Config()
+            : width(0),
+              height(0),
+              timescale(0),
+              framerate(0),
+              bitrate(0),
+              parameterSetId(1),
+              keepFrom(0)
+        {
+        }
+
+        // Parameter sets of the source track, without start codes
+        std::vector<std::vector<uint8_t>> sps;
+        std::vector<std::vector<uint8_t>> pps;
+        int width;
+        int height;
+        // Of the sample timestamps
+        unsigned int timescale;
+        int framerate;
+        int64_t bitrate;
+        int parameterSetId;
+        // Frames with earlier timestamps are only decoded
+        int64_t keepFrom;
+    };
+
+    struct Sample
+    {
+        // Length prefixed NAL units, like the samples of the source
+        std::vector<uint8_t> data;
+        int64_t timestamp;
+        bool keyFrame;
+    };
+
+    GopReencoder();
+    ~GopReencoder();
+
+    void configure(const Config &config);
+    // Samples have to be passed in decode order, starting with a key frame
+    bool addSample(const uint8_t *data, size_t size, int64_t timestamp);
+    // Drains decoder and encoder, samples() is complete afterwards
+    bool finish();
+
+    const std::vector<Sample> &samples() const { return m_samples; }
+    // Parameter sets of the new samples, without start codes
+    const std::vector<std::vector<uint8_t>> &sps() const { return m_sps; }
+    const std::vector<std::vector<uint8_t>> &pps() const { return m_pps; }
+
+private:
+    bool openEncoder(const AVFrame *frame);
+    bool decode(const AVPacket *packet);
+    bool encode(AVFrame *frame);
+    void release();
+
+    Config m_config;
+    AVCodecContext *m_decoder = nullptr;
+    AVCodecContext *m_encoder = nullptr;
+    AVFrame *m_frame = nullptr;
+    AVPacket *m_input = nullptr;
+    AVPacket *m_output = nullptr;
+    bool m_idrSent = false;
+    std::vector<Sample> m_samples;
+    std::vector<std::vector<uint8_t>> m_sps;
+    std::vector<std::vector<uint8_t>> m_pps;
+};
+
+#endif // MUXERS_GOP_REENCODER_H
@@ -16,6 +16,7 @@
  */
 
 #include "mp4.h"
+#include <algorithm>
 #include <array>
 #include <string>
 #include <stdexcept>
@@ -28,9 +29,25 @@
 
 QAudioFormat audioFormatCheck();
 
-MuxMp4::MuxMp4(QObject* parent) : QObject(parent), m_trackId{-1}
+namespace {
+static constexpr int64_t kVideoTimescale = 90000;
+// Samples per AAC-LC frame, the audio track runs at the sample rate
+static constexpr unsigned kAacFrameSize = 1024;
+
+// Round instead of truncating each duration on its own, otherwise the
+// error adds up over the recording.
+int64_t to90kHz(int64_t us)
 {
+    return (us * kVideoTimescale + 500000) / 1000000;
+}
+} // namespace
 
+MuxMp4::MuxMp4(QObject* parent) : QObject(parent), m_trackId{-1}
+{
+    // Keep a few staging buffers in flight so a slow write doesn't hold
+    // up muxing, and make sure long recordings reach the disk regularly.
+    m_storageConfig.queueDepth = 4;
+    m_storageConfig.syncPolicy = FileSink::SyncPolicy::Periodic;
 }
 
 MuxMp4::~MuxMp4()
@@ -38,11 +55,15 @@ MuxMp4::~MuxMp4()
     stop();
 }
 
-void MuxMp4::setupAudioTrack()
+void MuxMp4::setupAudioTrack(const QAudioFormat &format, const QByteArray &decoderSpecificInfo)
 {
-    MP4E_track_t ret;
-    QAudioFormat format = audioFormatCheck();
+    if (m_running) {
+        qWarning() << "can't add an audio track while muxing";
+        return;
+    }
 
+    MP4E_track_t ret;
+    std::copy_n("und", sizeof(ret.language), ret.language);
     ret.object_type_indication = MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3;
     ret.track_media_kind = e_audio;
     ret.time_scale = format.sampleRate();
@@ -50,25 +71,74 @@ void MuxMp4::setupAudioTrack()
     ret.u.a.channelcount = format.channelCount();
 
     m_audioTrack = ret;
+    m_audioDsi = decoderSpecificInfo;
     m_micAudio = true;
 }
 
+void MuxMp4::setTiming(Timing timing, int framerate, int reorderWindow)
+{
+    if (m_running) {
+        qWarning() << "can't change sample timing while muxing";
+        return;
+    }
+
+    m_timing = timing;
+    m_framerate = framerate > 0 ? framerate : 30;
+    m_reorderWindow = std::max(reorderWindow, 0);
+}
+
+void MuxMp4::setStorageConfig(const FileSink::Config &config)
+{
+    if (m_running) {
+        qWarning() << "can't change storage configuration while muxing";
+        return;
+    }
+
+    m_storageConfig = config;
+}
+
+void MuxMp4::setFragmented(bool fragmented, const std::chrono::milliseconds &fragmentDuration)
+{
+    if (m_running) {
+        qWarning() << "can't change fragmentation while muxing";
+        return;
+    }
+
+    m_fragmented = fragmented;
+    m_fragmentDuration = fragmentDuration;
+}
+
 static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
 {
-    qDebug() << "writing to file" << size;
-    QFile *file = static_cast<QFile *>(token);
-    file->seek(offset);
-    return file->write((const char *)buffer, size) != size;
+    FileSink *sink = static_cast<FileSink *>(token);
+    return !sink->write(offset, buffer, size);
 }
 
 void MuxMp4::start(const QString fileName, const int width, const int height)
 {
-    m_file.setFileName(fileName);
-    m_file.open(QIODevice::WriteOnly);
-    m_mux = MP4E_open(0, 0, (void *)&m_file, write_callback);
+    m_sink = std::make_unique<FileSink>(m_storageConfig);
+    m_sink->setBackPressureCallback([this](bool congested) {
+        Q_EMIT storageCongested(congested);
+    });
+    if (!m_sink->open(fileName)) {
+        throw std::runtime_error("failed to open output file");
+    }
+    m_mux = MP4E_open(0, m_fragmented ? 1 : 0, (void *)m_sink.get(), write_callback);
+    if (!m_mux) {
+        throw std::runtime_error("failed to create mp4 muxer");
+    }
+    if (m_fragmented) {
+        MP4E_set_fragment_duration(m_mux, static_cast<unsigned>(m_fragmentDuration.count()));
+    }
 
-    if (m_micAudio)
+    if (m_micAudio) {
         m_trackId = MP4E_add_track(m_mux, &m_audioTrack);
+        if (m_trackId < 0 ||
+            MP4E_STATUS_OK != MP4E_set_dsi(m_mux, m_trackId, m_audioDsi.constData(), m_audioDsi.size())) {
+            qCritical() << "failed to add audio track";
+            m_trackId = -1;
+        }
+    }
 
     qDebug() << "before mp4_h26x_write_init";
 
@@ -82,50 +152,92 @@ void MuxMp4::start(const QString fileName, const int width, const int height)
     m_running = true;
 }
 
-static ssize_t get_nal_size(uint8_t *buf, ssize_t size)
+void MuxMp4::writeNals(const Buffer::Ptr &buffer, unsigned duration)
 {
-    ssize_t pos = 3;
-    while ((size - pos) > 3) {
-        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
-            return pos;
-        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 0 && buf[pos + 3] == 1)
-            return pos;
-        pos++;
+    // Locate all NAL units with a single scan and hand them over one by
+    // one, so minimp4 doesn't have to look for start codes again.
+    m_nals.clear();
+    splitNalUnits(buffer->Data(), buffer->Length(), m_nals);
+
+    for (const auto &nal : m_nals) {
+        if (MP4E_STATUS_OK != mp4_h26x_write_nal_unit(&m_mp4wr, nal.data, nal.size, duration)) {
+            qCritical() << "mp4_h26x_write_nal_unit failed";
+        }
     }
-    return size;
 }
 
-// basically https://github.com/lieff/minimp4/blob/master/minimp4_test.c#L278-L300 - CC0
-void MuxMp4::addBuffer(const Buffer::Ptr &buffer, const bool hasCodecConfig)
+void MuxMp4::writePending()
 {
-    qDebug() << "MuxMp4 got buffer";
-    uint8_t *bufH264 = buffer->Data();
-    uint32_t h264Size = buffer->Length();
-
-    while (h264Size > 0) {
-        ssize_t nalSize = get_nal_size(bufH264, h264Size);
+    const auto buffer = m_pending.front();
+    m_pending.pop_front();
+
+    // Samples keep their decode order, the timestamps are assigned in
+    // ascending order. A timestamp which arrives after we've already
+    // moved past it is clamped to the current end of the track.
+    const auto first = m_pendingTimestamps.begin();
+    const auto dts = to90kHz(*first);
+    m_pendingTimestamps.erase(first);
+
+    if (m_nextDts < 0) {
+        // The track starts at media time zero like the audio track, the
+        // first frame is shown until its successor.
+        m_nextDts = 0;
+    }
+    if (dts < m_nextDts) {
+        m_lateSamples++;
+    }
 
-        if (nalSize < 4) {
-            bufH264 += 1;
-            h264Size -= 1;
-            continue;
+    const unsigned nominal = kVideoTimescale / m_framerate;
+    unsigned duration = nominal;
+    if (m_timing == Timing::Variable) {
+        if (!m_pendingTimestamps.empty()) {
+            duration = std::max<int64_t>(to90kHz(*m_pendingTimestamps.begin()) - m_nextDts, 1);
+        } else if (m_lastDuration > 0) {
+            // The last frame of the recording has no successor
+            duration = m_lastDuration;
         }
+    }
 
-        if (MP4E_STATUS_OK != mp4_h26x_write_nal(&m_mp4wr, bufH264, nalSize, 90000 / 30)) {
-            qCritical() << "mp4_h26x_write_nal failed";
-        }
+    writeNals(buffer, duration);
+    m_nextDts += duration;
+    m_lastDuration = duration;
+
+    Q_EMIT frameAppended(buffer->Timestamp());
+}
 
-        bufH264 += nalSize;
-        h264Size -= nalSize;
+void MuxMp4::addBuffer(const Buffer::Ptr &buffer, const bool hasCodecConfig)
+{
+    // Late encoder output must not reach the writer stop() has closed
+    if (!m_running)
+        return;
+
+    qDebug() << "MuxMp4 got buffer";
+
+    // Parameter sets don't form a sample, no need to hold them back
+    if (hasCodecConfig) {
+        writeNals(buffer, 0);
+        return;
+    }
+
+    // A sample's duration is only known once the next one arrived
+    m_pending.push_back(buffer);
+    m_pendingTimestamps.insert(buffer->Timestamp());
+    while (m_pending.size() > static_cast<size_t>(m_reorderWindow) + 1) {
+        writePending();
     }
 }
 
 void MuxMp4::addAudioBuffer(const Buffer::Ptr &buffer)
 {
-    if (m_trackId == -1)
+    if (!m_running || m_trackId == -1)
         return;
 
-    MP4E_put_sample(m_mux, m_trackId, buffer->Data(), buffer->Length(), buffer->Timestamp(), MP4E_SAMPLE_DEFAULT);
+    // Every AAC frame can be decoded on its own
+    if (MP4E_STATUS_OK != MP4E_put_sample(m_mux, m_trackId, buffer->Data(), buffer->Length(), kAacFrameSize,
+                                          MP4E_SAMPLE_RANDOM_ACCESS)) {
+        qCritical() << "failed to write audio sample";
+    }
+    buffer->Release();
 }
 
 void MuxMp4::stop()
@@ -135,10 +247,25 @@ void MuxMp4::stop()
         return;
     }
 
+    while (!m_pending.empty()) {
+        writePending();
+    }
+    if (m_lateSamples > 0) {
+        qWarning() << m_lateSamples << "video samples arrived too late to be reordered";
+    }
+
     MP4E_close(m_mux);
     mp4_h26x_write_close(&m_mp4wr);
-    m_file.close();
+    if (!m_sink->close()) {
+        qCritical() << "failed to write recording to disk";
+    }
+    m_sink.reset();
     m_running = false;
+    m_micAudio = false;
+    m_trackId = -1;
+    m_nextDts = -1;
+    m_lastDuration = 0;
+    m_lateSamples = 0;
 
     qDebug() << "stopped MuxMp4";
 }
@@ -148,10 +275,10 @@ QAudioFormat audioFormatCheck()
     QAudioFormat format;
     format.setSampleRate(48000);
     format.setChannelCount(1);
-    format.setSampleSize(8);
+    format.setSampleSize(16);
     format.setCodec("audio/pcm");
     format.setByteOrder(QAudioFormat::LittleEndian);
-    format.setSampleType(QAudioFormat::UnSignedInt);
+    format.setSampleType(QAudioFormat::SignedInt);
 
     QAudioDeviceInfo info = QAudioDeviceInfo::defaultInputDevice();
     if (!info.isFormatSupported(format)) {
@@ -20,8 +20,14 @@
 
 #include <QObject>
 #include <QAudioFormat>
-#include <QFile>
+#include <QByteArray>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <set>
 #include "../minimp4.h"
+#include "annexb.h"
+#include "filesink.h"
 #include "mux.h"
 
 class MuxMp4 : public QObject, public Mux
@@ -33,11 +39,36 @@ public:
     MuxMp4(QObject* parent = nullptr);
     ~MuxMp4();
 
+    enum class Timing {
+        // Sample durations follow the encoder timestamps, so dropped or
+        // skipped frames simply make the previous one last longer.
+        Variable,
+        // Every sample lasts exactly one frame at the nominal rate.
+        Constant,
+    };
+
+    // Must be called before start(). Up to reorderWindow samples are held
+    // back so that a late timestamp can still be put in order.
+    void setTiming(Timing timing, int framerate, int reorderWindow = 2);
+    // Must be called before start()
+    void setStorageConfig(const FileSink::Config &config);
+    // Must be called before start(). Writes the index up front and the
+    // samples as moof/mdat fragments, so an interrupted recording stays
+    // playable up to the last fragment. A fragment starts at every key
+    // frame and, if a duration is given, once it spans that long.
+    void setFragmented(bool fragmented,
+                       const std::chrono::milliseconds &fragmentDuration = std::chrono::milliseconds{ 0 });
+    // Must be called before start(). Adds an AAC track, its samples are
+    // passed to addAudioBuffer() one encoder frame at a time.
+    void setupAudioTrack(const QAudioFormat &format, const QByteArray &decoderSpecificInfo);
+
 Q_SIGNALS:
     void frameAppended(int64_t timestamp) override;
+    // Emitted from the I/O thread when writes start or stop waiting for
+    // the storage to catch up.
+    void storageCongested(bool congested);
 
 public Q_SLOTS:
-    void setupAudioTrack();
     void addBuffer(const Buffer::Ptr &buffer, const bool hasCodecConfig) override;
     void addAudioBuffer(const Buffer::Ptr &buffer) override;
     void start(const QString fileName, const int width, const int height) override;
@@ -47,13 +78,34 @@ public:
     QAudioFormat audioFormat();
 
 private:
+    void writeNals(const Buffer::Ptr &buffer, unsigned duration);
+    void writePending();
+
     bool m_running = false;
     bool m_micAudio = false;
-    QFile m_file;
+    FileSink::Config m_storageConfig;
+    bool m_fragmented = false;
+    std::chrono::milliseconds m_fragmentDuration{ 0 };
+    std::unique_ptr<FileSink> m_sink;
     MP4E_mux_t *m_mux;
     mp4_h26x_writer_t m_mp4wr;
     int m_trackId;
     MP4E_track_t m_audioTrack;
+    QByteArray m_audioDsi;
+
+    Timing m_timing = Timing::Variable;
+    int m_framerate = 30;
+    int m_reorderWindow = 2;
+    // Access units waiting for their successor's timestamp, in decode order
+    std::deque<Buffer::Ptr> m_pending;
+    // Their timestamps, handed out in ascending order
+    std::multiset<int64_t> m_pendingTimestamps;
+    // End of the last written sample on the 90 kHz track timeline
+    int64_t m_nextDts = -1;
+    unsigned m_lastDuration = 0;
+    uint64_t m_lateSamples = 0;
+    // Scratch list, kept to avoid reallocating for every access unit
+    std::vector<NalSpan> m_nals;
 };
 
 #endif // MUXERS_MP4_H
@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trimmer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QFile>
+
+#include "../minimp4.h"
+#include "filesink.h"
+#include "gop_reencoder.h"
+
+namespace {
+// Samples are read in blocks of this size. Recordings interleave their
+// tracks chunk by chunk, so one block serves all tracks.
+static constexpr size_t kReadBlockSize = 4 * 1024 * 1024;
+
+int read_callback(int64_t offset, void *buffer, size_t size, void *token)
+{
+    const int fd = *static_cast<int *>(token);
+    auto data = static_cast<uint8_t *>(buffer);
+
+    while (size > 0) {
+        const auto n = ::pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    FileSink *sink = static_cast<FileSink *>(token);
+    return !sink->write(offset, buffer, size);
+}
+
+// Walks the samples of a track in file order. MP4D_frame_offset() scans
+// the chunk table from the start for every sample it is asked about.
+class SampleCursor
+{
+public:
+    SampleCursor(const MP4D_track_t *track, unsigned sample) : m_track(track)
+    {
+        enterChunk(0);
+        while (sample >= m_chunkEnd && m_chunk + 1 < m_track->chunk_count)
+            enterChunk(m_chunk + 1);
+        while (m_sample < sample) {
+            m_offset += size();
+            m_sample++;
+        }
+    }
+
+    unsigned sample() const { return m_sample; }
+    uint64_t offset() const { return m_offset; }
+    unsigned size() const { return m_track->entry_size[m_sample]; }
+
+    void next()
+    {
+        const auto previous = size();
+        if (++m_sample >= m_chunkEnd && m_chunk + 1 < m_track->chunk_count)
+            enterChunk(m_chunk + 1);
+        else
+            m_offset += previous;
+    }
+
+private:
+    // Same rules as the demuxer: a file with a single chunk keeps all
+    // samples in it no matter what the sample to chunk table says.
+    void enterChunk(unsigned chunk)
+    {
+        const auto table = m_track->sample_to_chunk;
+        if (chunk > 0 && m_group + 1 < m_track->sample_to_chunk_count &&
+            chunk + 1 == table[m_group + 1].first_chunk)
+            m_group++;
+
+        m_chunk = chunk;
+        m_sample = m_chunkEnd;
+        if (m_track->chunk_count <= 1 || !m_track->sample_to_chunk_count)
+            m_chunkEnd = m_track->sample_count;
+        else
+            m_chunkEnd += table[m_group].samples_per_chunk;
+        m_offset = m_track->chunk_count ? m_track->chunk_offset[chunk] : 0;
+    }
+
+    const MP4D_track_t *m_track;
+    unsigned m_chunk = 0;
+    unsigned m_group = 0;
+    unsigned m_sample = 0;
+    unsigned m_chunkEnd = 0;
+    uint64_t m_offset = 0;
+};
+
+struct TrackRange
+{
+    unsigned input;
+    int output;
+    bool video;
+    unsigned begin;
+    unsigned end;
+    // Next entry of the sync sample table
+    unsigned sync;
+    // Video frames are cut to this span, in track timescale units
+    uint64_t clipFrom;
+    uint64_t clipTo;
+    // Re-encoded replacements of the samples before headEnd
+    unsigned headEnd;
+    std::vector<GopReencoder::Sample> head;
+    std::vector<std::vector<uint8_t>> headSps;
+    std::vector<std::vector<uint8_t>> headPps;
+};
+
+// First sample starting at or after the given time
+unsigned sampleAt(const MP4D_track_t &track, uint64_t time)
+{
+    const auto begin = track.timestamp;
+    const auto end = track.timestamp + track.sample_count;
+    return std::lower_bound(begin, end, time) - begin;
+}
+
+// Sync sample following the given one, or the sample count if there is none
+unsigned nextSyncSample(const MP4D_track_t &track, unsigned sample)
+{
+    if (!track.sync_sample)
+        return std::min(sample + 1, track.sample_count);
+    const auto end = track.sync_sample + track.sync_sample_count;
+    const auto next = std::upper_bound(track.sync_sample, end, sample);
+    return next != end ? *next : track.sample_count;
+}
+
+// seq_parameter_set_id follows profile, constraint flags and level,
+// pic_parameter_set_id comes first.
+unsigned parameterSetId(const uint8_t *nal, int size, bool sps)
+{
+    int bit = sps ? 32 : 8;
+    const auto read = [&]() {
+        const int byte = bit / 8;
+        const int value = byte < size ? (nal[byte] >> (7 - bit % 8)) & 1 : 1;
+        bit++;
+        return value;
+    };
+
+    int zeros = 0;
+    while (!read() && zeros < 31)
+        zeros++;
+    unsigned value = 0;
+    for (int i = 0; i < zeros; i++)
+        value = (value << 1) | read();
+    return (1u << zeros) - 1 + value;
+}
+
+// Encodes the frames from first up to the next key frame again, so the
+// cut can start with a key frame at first. Only the group of pictures
+// around the start is decoded.
+bool reencodeHead(const MP4D_demux_t &mp4, int *token, TrackRange &range, unsigned first)
+{
+    const MP4D_track_t &track = mp4.track[range.input];
+    const auto next = nextSyncSample(track, first);
+    const auto headEnd = std::min(next, range.end);
+    if (headEnd <= first)
+        return false;
+
+    GopReencoder::Config config;
+    unsigned lastId = 0;
+    int bytes = 0;
+    const void *nal;
+    for (int i = 0; (nal = MP4D_read_sps(&mp4, range.input, i, &bytes)); i++) {
+        const auto data = static_cast<const uint8_t *>(nal);
+        config.sps.emplace_back(data, data + bytes);
+        lastId = std::max(lastId, parameterSetId(data, bytes, true));
+    }
+    for (int i = 0; (nal = MP4D_read_pps(&mp4, range.input, i, &bytes)); i++) {
+        const auto data = static_cast<const uint8_t *>(nal);
+        config.pps.emplace_back(data, data + bytes);
+        lastId = std::max(lastId, parameterSetId(data, bytes, false));
+    }
+    // x264 uses the same id for its SPS and PPS
+    if (lastId >= 31) {
+        qWarning() << "no free parameter set id for re-encoding";
+        return false;
+    }
+
+    // Aim for the bitrate of the group of pictures which gets replaced
+    uint64_t groupBytes = 0;
+    for (auto i = range.begin; i < next; i++)
+        groupBytes += track.entry_size[i];
+    const uint64_t span = track.timestamp[next - 1] + track.duration[next - 1] -
+                          track.timestamp[range.begin];
+
+    config.width = track.SampleDescription.video.width;
+    config.height = track.SampleDescription.video.height;
+    config.timescale = track.timescale;
+    config.framerate = span ? static_cast<int>((next - range.begin) * track.timescale / span) : 0;
+    config.bitrate = span ? static_cast<int64_t>(groupBytes * 8 * track.timescale / span) : 0;
+    config.parameterSetId = lastId + 1;
+    config.keepFrom = track.timestamp[first];
+
+    GopReencoder reencoder;
+    try {
+        reencoder.configure(config);
+    } catch (const std::runtime_error &e) {
+        qWarning() << "can't re-encode:" << e.what();
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    for (SampleCursor cursor(&track, range.begin); cursor.sample() < headEnd; cursor.next()) {
+        data.resize(cursor.size());
+        if (read_callback(cursor.offset(), data.data(), data.size(), token))
+            return false;
+        if (!reencoder.addSample(data.data(), data.size(), track.timestamp[cursor.sample()]))
+            return false;
+    }
+    if (!reencoder.finish())
+        return false;
+
+    // Durations are taken from the samples which get replaced
+    const auto &samples = reencoder.samples();
+    if (samples.size() != headEnd - first || !samples.front().keyFrame ||
+        reencoder.sps().empty() || reencoder.pps().empty()) {
+        qWarning() << "re-encoding produced" << samples.size() << "instead of" << headEnd - first
+                   << "frames";
+        return false;
+    }
+
+    range.head = samples;
+    range.headSps = reencoder.sps();
+    range.headPps = reencoder.pps();
+    range.headEnd = headEnd;
+    return true;
+}
+
+unsigned sampleDuration(const MP4D_track_t &track, const TrackRange &range, unsigned sample)
+{
+    // Audio frames always play in full
+    if (!range.video)
+        return track.duration[sample];
+    const uint64_t begin = std::max<uint64_t>(track.timestamp[sample], range.clipFrom);
+    const uint64_t end = std::min<uint64_t>(uint64_t(track.timestamp[sample]) + track.duration[sample],
+                                            range.clipTo);
+    return end > begin ? static_cast<unsigned>(end - begin) : 0;
+}
+
+bool isSync(const MP4D_track_t &track, TrackRange &range, unsigned sample)
+{
+    if (!track.sync_sample)
+        return true;
+    while (range.sync < track.sync_sample_count && track.sync_sample[range.sync] < sample)
+        range.sync++;
+    return range.sync < track.sync_sample_count && track.sync_sample[range.sync] == sample;
+}
+
+bool setupTrack(MP4E_mux_t *mux, const MP4D_demux_t &mp4, TrackRange &range)
+{
+    const MP4D_track_t &track = mp4.track[range.input];
+
+    MP4E_track_t out;
+    std::memcpy(out.language, track.language, sizeof(out.language));
+    out.object_type_indication = track.object_type_indication;
+    out.time_scale = track.timescale;
+    out.default_duration = 0;
+    if (range.video) {
+        out.track_media_kind = e_video;
+        out.u.v.width = track.SampleDescription.video.width;
+        out.u.v.height = track.SampleDescription.video.height;
+    } else {
+        out.track_media_kind = e_audio;
+        out.u.a.channelcount = track.SampleDescription.audio.channelcount;
+    }
+
+    range.output = MP4E_add_track(mux, &out);
+    if (range.output < 0)
+        return false;
+
+    if (!range.video)
+        return MP4E_set_dsi(mux, range.output, track.dsi, track.dsi_bytes) == MP4E_STATUS_OK;
+
+    int bytes = 0;
+    const void *nal;
+    for (int i = 0; (nal = MP4D_read_sps(&mp4, range.input, i, &bytes)); i++) {
+        if (MP4E_set_sps(mux, range.output, nal, bytes) != MP4E_STATUS_OK)
+            return false;
+    }
+    for (int i = 0; (nal = MP4D_read_pps(&mp4, range.input, i, &bytes)); i++) {
+        if (MP4E_set_pps(mux, range.output, nal, bytes) != MP4E_STATUS_OK)
+            return false;
+    }
+    for (const auto &sps : range.headSps) {
+        if (MP4E_set_sps(mux, range.output, sps.data(), sps.size()) != MP4E_STATUS_OK)
+            return false;
+    }
+    for (const auto &pps : range.headPps) {
+        if (MP4E_set_pps(mux, range.output, pps.data(), pps.size()) != MP4E_STATUS_OK)
+            return false;
+    }
+    return true;
+}
+} // namespace
+
+Mp4Trimmer::Mp4Trimmer(QObject *parent) : QObject(parent)
+{
+}
+
+void Mp4Trimmer::cancel()
+{
+    m_cancelled = true;
+}
+
+void Mp4Trimmer::trim(const QString &input, const QString &output, qint64 from, qint64 to)
+{
+    Q_EMIT progress(0);
+
+    const bool success = !m_cancelled && copy(input, output, from, to);
+    if (!success)
+        QFile::remove(output);
+
+    m_cancelled = false;
+    Q_EMIT finished(success, output);
+}
+
+bool Mp4Trimmer::copy(const QString &input, const QString &output, qint64 from, qint64 to)
+{
+    const int fd = ::open(QFile::encodeName(input).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        qCritical() << "failed to open" << input << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        qCritical() << "failed to stat" << input << strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    MP4D_demux_t mp4;
+    std::memset(&mp4, 0, sizeof(mp4));
+    int token = fd;
+    if (!MP4D_open(&mp4, read_callback, &token, st.st_size)) {
+        qCritical() << "failed to parse" << input;
+        MP4D_close(&mp4);
+        ::close(fd);
+        return false;
+    }
+
+    // The cut follows the video track, other tracks are cut to the same
+    // time span.
+    std::vector<TrackRange> ranges;
+    int reference = -1;
+    for (unsigned i = 0; i < mp4.track_count; i++) {
+        const auto &track = mp4.track[i];
+        const bool video = track.handler_type == MP4D_HANDLER_TYPE_VIDE &&
+                           track.object_type_indication == MP4_OBJECT_TYPE_AVC;
+        const bool audio = track.handler_type == MP4D_HANDLER_TYPE_SOUN && track.dsi;
+        if (!video && !audio) {
+            qWarning() << "skipping unsupported track" << i;
+            continue;
+        }
+        if (!track.sample_count || !track.timescale || !track.timestamp)
+            continue;
+        if (video && reference < 0)
+            reference = ranges.size();
+        TrackRange range = {};
+        range.input = i;
+        range.output = -1;
+        range.video = video;
+        range.clipTo = UINT64_MAX;
+        ranges.push_back(std::move(range));
+    }
+    if (ranges.empty()) {
+        qCritical() << "nothing to copy in" << input;
+        MP4D_close(&mp4);
+        ::close(fd);
+        return false;
+    }
+    if (reference < 0)
+        reference = 0;
+
+    for (auto &range : ranges) {
+        const auto &track = mp4.track[range.input];
+        range.end = to > 0 ? sampleAt(track, static_cast<uint64_t>(to) * track.timescale / 1000)
+                           : track.sample_count;
+    }
+
+    // Start on the key frame at or before the requested position, so the
+    // first frames decode without what came before them. In exact mode
+    // the frames up to the next key frame are encoded again instead.
+    double start;
+    bool exact = false;
+    {
+        auto &range = ranges[reference];
+        const auto &track = mp4.track[range.input];
+        const auto fromTime = static_cast<uint64_t>(std::max<qint64>(from, 0)) * track.timescale / 1000;
+        auto first = sampleAt(track, fromTime + 1);
+        first = first > 0 ? first - 1 : 0;
+        range.begin = MP4D_sync_sample_before(&mp4, range.input, first);
+        range.clipFrom = track.timestamp[range.begin];
+
+        if (m_mode == Mode::Exact && range.video) {
+            exact = range.begin == first || reencodeHead(mp4, &token, range, first);
+            if (exact) {
+                range.begin = first;
+                range.clipFrom = std::max<uint64_t>(fromTime, track.timestamp[first]);
+                if (to > 0)
+                    range.clipTo = static_cast<uint64_t>(to) * track.timescale / 1000;
+            } else {
+                qWarning() << "falling back to cutting at the key frame before" << from;
+            }
+        }
+        start = static_cast<double>(range.clipFrom) / track.timescale;
+    }
+
+    uint64_t total = 0;
+    for (auto &range : ranges) {
+        const auto &track = mp4.track[range.input];
+        if (&range != &ranges[reference]) {
+            const auto startTime = start * track.timescale;
+            range.begin = sampleAt(track, static_cast<uint64_t>(startTime + 0.5));
+            // Keep the audio as close to the first frame as its frames allow
+            if (exact && range.begin > 0 &&
+                (range.begin == track.sample_count ||
+                 startTime - track.timestamp[range.begin - 1] < track.timestamp[range.begin] - startTime))
+                range.begin--;
+        }
+        range.end = std::max(range.end, range.begin);
+        for (auto i = range.begin; i < range.end; i++)
+            total += track.entry_size[i];
+    }
+
+    FileSink::Config config;
+    config.queueDepth = 2;
+    FileSink sink(config);
+    if (!sink.open(output)) {
+        qCritical() << "failed to open" << output;
+        MP4D_close(&mp4);
+        ::close(fd);
+        return false;
+    }
+
+    MP4E_mux_t *mux = MP4E_open(0, 0, &sink, write_callback);
+    bool ok = mux != nullptr;
+    for (auto &range : ranges) {
+        if (ok && !setupTrack(mux, mp4, range)) {
+            qCritical() << "failed to set up output track for" << range.input;
+            ok = false;
+        }
+    }
+
+    std::vector<SampleCursor> cursors;
+    cursors.reserve(ranges.size());
+    for (const auto &range : ranges)
+        cursors.emplace_back(&mp4.track[range.input], range.begin);
+
+    // Copy in file order, which keeps the reads sequential however the
+    // tracks are interleaved.
+    std::vector<uint8_t> block;
+    uint64_t blockOffset = 0;
+    size_t blockSize = 0;
+    uint64_t copied = 0;
+    int percent = 0;
+    while (ok) {
+        int next = -1;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (cursors[i].sample() >= ranges[i].end)
+                continue;
+            if (next < 0 || cursors[i].offset() < cursors[next].offset())
+                next = i;
+        }
+        if (next < 0)
+            break;
+
+        if (m_cancelled) {
+            qDebug() << "trimming cancelled";
+            ok = false;
+            break;
+        }
+
+        auto &cursor = cursors[next];
+        auto &range = ranges[next];
+        const auto &track = mp4.track[range.input];
+        const auto offset = cursor.offset();
+        const auto size = cursor.size();
+        const uint8_t *data;
+        int bytes = size;
+        int kind;
+        if (cursor.sample() < range.headEnd) {
+            const auto &sample = range.head[cursor.sample() - range.begin];
+            data = sample.data.data();
+            bytes = sample.data.size();
+            kind = sample.keyFrame ? MP4E_SAMPLE_RANDOM_ACCESS : MP4E_SAMPLE_DEFAULT;
+        } else {
+            if (offset < blockOffset || offset + size > blockOffset + blockSize) {
+                blockOffset = offset;
+                blockSize = std::max<uint64_t>(size, std::min<uint64_t>(kReadBlockSize, st.st_size - offset));
+                if (block.size() < blockSize)
+                    block.resize(blockSize);
+                if (read_callback(blockOffset, block.data(), blockSize, &token)) {
+                    qCritical() << "failed to read" << input << "at" << blockOffset;
+                    blockSize = 0;
+                    ok = false;
+                    break;
+                }
+            }
+            data = block.data() + (offset - blockOffset);
+            // Audio frames all decode on their own
+            kind = !range.video || isSync(track, range, cursor.sample()) ? MP4E_SAMPLE_RANDOM_ACCESS
+                                                                         : MP4E_SAMPLE_DEFAULT;
+        }
+
+        if (MP4E_put_sample(mux, range.output, data, bytes,
+                            sampleDuration(track, range, cursor.sample()), kind) != MP4E_STATUS_OK) {
+            qCritical() << "failed to write sample" << cursor.sample() << "of track" << range.input;
+            ok = false;
+            break;
+        }
+
+        copied += size;
+        const int current = total ? static_cast<int>(copied * 100 / total) : 100;
+        if (current != percent) {
+            percent = current;
+            Q_EMIT progress(percent);
+        }
+        cursor.next();
+    }
+
+    if (mux && MP4E_close(mux) != MP4E_STATUS_OK)
+        ok = false;
+    if (!sink.close())
+        ok = false;
+    MP4D_close(&mp4);
+    ::close(fd);
+
+    if (ok)
+        qDebug() << "trimmed" << input << "to" << output << "copying" << copied << "bytes";
+    return ok;
+}
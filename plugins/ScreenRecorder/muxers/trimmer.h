@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MUXERS_TRIMMER_H
+#define MUXERS_TRIMMER_H
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+
+// Cuts a range out of an MP4 recording. Samples are copied as they are,
+// in exact mode only the frames between the requested start and the next
+// key frame are encoded again.
+//
+// Meant to live on a worker thread, trim() blocks until the file is
+// written.
+class Mp4Trimmer : public QObject
+{
+    Q_OBJECT
+public:
+    enum class Mode {
+        // Start at the key frame at or before the requested start
+        KeyFrame,
+        // Start and end on the requested millisecond
+        Exact,
+    };
+
+    explicit Mp4Trimmer(QObject *parent = nullptr);
+
+    void setMode(Mode mode) { m_mode = mode; }
+
+    // May be called from any thread. A running trim() stops at the next
+    // sample and removes its output, a trim() which hasn't started yet
+    // is skipped.
+    void cancel();
+
+public Q_SLOTS:
+    // from and to are in milliseconds
+    void trim(const QString &input, const QString &output, qint64 from, qint64 to);
+
+Q_SIGNALS:
+    void progress(int percent);
+    void finished(bool success, const QString &output);
+
+private:
+    bool copy(const QString &input, const QString &output, qint64 from, qint64 to);
+
+    Mode m_mode = Mode::KeyFrame;
+    std::atomic<bool> m_cancelled{ false };
+};
+
+#endif // MUXERS_TRIMMER_H
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <cstdint>
+
+// Layout of CPU side frames, named after the byte order in memory.
+enum class PixelFormat {
+    RGBA8888,
+    BGRA8888,
+    RGBX8888,
+    BGRX8888,
+};
+
+inline uint32_t bytesPerPixel(PixelFormat format)
+{
+    switch (format) {
+    case PixelFormat::RGBA8888:
+    case PixelFormat::BGRA8888:
+    case PixelFormat::RGBX8888:
+    case PixelFormat::BGRX8888:
+        return 4;
+    }
+    return 4;
+}
+
+inline bool isBgrOrder(PixelFormat format)
+{
+    return format == PixelFormat::BGRA8888 || format == PixelFormat::BGRX8888;
+}
+
+#endif // PIXEL_FORMAT_H
@@ -23,14 +23,15 @@
 #include "./captures/mir.h"
 #include "./encoders/encoder.h"
 #include "./muxers/mux.h"
-#include "./muxers/mp4.h"
 
-ScreenRecorder::ScreenRecorder(QObject *parent) : QObject(parent), m_mic{false}
+ScreenRecorder::ScreenRecorder(QObject *parent) : QObject(parent)
 {
+    m_timer.setInterval(1000);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(tick()));
 }
 
 void ScreenRecorder::setup(QSharedPointer<QObject> encoder, QSharedPointer<QObject> capture,
-                           QSharedPointer<QObject> mux)
+                           QSharedPointer<QObject> mux, QSharedPointer<MicrophoneCapture> microphone)
 {
     if (!encoder || !capture || !mux) {
         qCritical() << "passed null pointers to encoder, capture or mux";
@@ -53,16 +54,24 @@ void ScreenRecorder::setup(QSharedPointer<QObject> encoder, QSharedPointer<QObje
     m_encoder = encoder;
     m_capture = capture;
     m_mux = mux;
+    m_microphone = microphone;
+
+    m_clock = MediaClock::create();
+    qobject_cast<Capture *>(m_capture.data())->setClock(m_clock);
+    if (m_microphone)
+        m_microphone->setClock(m_clock);
 
     // Indicator
     m_indicator = QSharedPointer<Indicator>(new Indicator());
+    m_pacer = QSharedPointer<FramePacer>(new FramePacer());
 
     m_encoder->moveToThread(&m_encoderThread);
     m_capture->moveToThread(&m_captureThread);
+    m_pacer->moveToThread(&m_captureThread);
     m_mux->moveToThread(&m_muxThread);
     m_indicator->moveToThread(&m_indicatorThread);
-
-    m_timer.setInterval(1000 / 60);
+    if (m_microphone)
+        m_microphone->moveToThread(&m_audioThread);
 
     // Video encode
     connect(m_capture.data(), SIGNAL(bufferAvailable(const Buffer::Ptr)), m_encoder.data(),
@@ -70,13 +79,21 @@ void ScreenRecorder::setup(QSharedPointer<QObject> encoder, QSharedPointer<QObje
     connect(m_encoder.data(), SIGNAL(bufferAvailable(const Buffer::Ptr, const bool)), m_mux.data(),
             SLOT(addBuffer(const Buffer::Ptr, const bool)));
     connect(m_encoder.data(), SIGNAL(bufferReturned()), this, SLOT(bufferAvailable()));
-    connect(&m_timer, SIGNAL(timeout()), m_capture.data(), SLOT(swapBuffers()));
-    connect(&m_timer, SIGNAL(timeout()), this, SLOT(tick()));
+    connect(m_pacer.data(), SIGNAL(frameDue()), m_capture.data(), SLOT(swapBuffers()),
+            Qt::DirectConnection);
+    connect(m_mux.data(), SIGNAL(storageCongested(bool)), this, SLOT(storageCongested(bool)));
+
+    // Audio encode
+    if (m_microphone) {
+        connect(m_microphone.data(), SIGNAL(bufferAvailable(const Buffer::Ptr)), m_mux.data(),
+                SLOT(addAudioBuffer(const Buffer::Ptr)));
+    }
 
     m_encoderThread.start();
     m_captureThread.start();
     m_muxThread.start();
     m_indicatorThread.start();
+    m_audioThread.start();
 }
 
 void ScreenRecorder::bufferAvailable()
@@ -84,75 +101,51 @@ void ScreenRecorder::bufferAvailable()
     qDebug() << "buffer returned";
 }
 
-void ScreenRecorder::start(float framerate, bool mic)
+void ScreenRecorder::start(float framerate)
 {
-#if 0
-    m_mic = mic;
-    if (mic) {
-        // Setup
-        const QAudioFormat format = static_cast<MuxMp4*>(m_mux.data())->audioFormat();
-        m_aacConverter = AacConverter(format.sampleRate(), format.channelCount());
-
-        // Audio capture
-        const QAudioDeviceInfo audioDevice(QAudioDeviceInfo::defaultInputDevice());
-        m_audioInput = QSharedPointer<QAudioInput>(new QAudioInput(audioDevice, format, this));
-        m_audioInput->moveToThread(&m_audioThread);
-        m_audioInput->setNotifyInterval(100);
-        connect(m_audioInput.data(), &QAudioInput::stateChanged, this,
-            [=](QAudio::State state){
-                qDebug() << "QAudioInput state changed:" << state;
-            }
-        );
-        connect(m_audioInput.data(), &QAudioInput::notify, this,
-            [=](){
-                qDebug() << "Reading microphone";
-                const auto readBytes = m_microphoneAudio->readAll();
-                qDebug() << "Read" << readBytes.size() << "bytes";
-                // m_mux->addAudioBuffer(Buffer:Create(readBytes.constData(), readBytes.size()))
-                unsigned int bufSize;
-                uint8_t* aacBuf = (uint8_t*)m_aacConverter.encodeWav(readBytes.constData(), readBytes.size(), bufSize);
-
-                qDebug() << "AAC buffer" << bufSize;
-                if (bufSize > 0) {
-                    static_cast<MuxMp4*>(m_mux.data())->addAudioBuffer(Buffer::Create(aacBuf, bufSize));
-                }
-            }
-        );
-        m_microphoneAudio = QSharedPointer<QIODevice>(m_audioInput->start());
-    }
-#endif
-
-    m_frames = 0;
-    m_timer.setInterval(static_cast<int>(1000.0f / framerate));
-    m_elapsed.start();
+    m_framerate = framerate;
+    m_clock->start();
     m_indicator->start();
     QMetaObject::invokeMethod(m_encoder.data(), "start", Qt::QueuedConnection);
     QMetaObject::invokeMethod(m_capture.data(), "start", Qt::QueuedConnection);
+    QMetaObject::invokeMethod(m_pacer.data(), "setFramerate", Qt::QueuedConnection,
+                              Q_ARG(double, framerate));
+    QMetaObject::invokeMethod(m_pacer.data(), "start", Qt::QueuedConnection);
+    if (m_microphone)
+        QMetaObject::invokeMethod(m_microphone.data(), "start", Qt::QueuedConnection);
     m_timer.start();
-#if 0
-    if (mic)
-        m_audioInput->resume();
-#endif
 }
 
 void ScreenRecorder::stop()
 {
-#if 0
-    if (m_mic)
-        m_audioInput->stop();
-#endif
+    // Blocks until the last audio frames are queued up for the mux
+    if (m_microphone)
+        QMetaObject::invokeMethod(m_microphone.data(), "stop", Qt::BlockingQueuedConnection);
+    // No frame is captured once this returns
+    QMetaObject::invokeMethod(m_pacer.data(), "stop", Qt::BlockingQueuedConnection);
     m_indicator->stop();
     m_timer.stop();
-    m_elapsed.invalidate();
-    qobject_cast<Capture *>(m_capture.data())->stop();
-    qobject_cast<Encoder *>(m_encoder.data())->stop();
+    // Runs after a swap completion still queued on the capture thread
+    QMetaObject::invokeMethod(m_capture.data(), "stop", Qt::BlockingQueuedConnection);
+    // The encoder is only ever touched from its own thread, this waits for
+    // the frames it still holds to be drained towards the mux.
+    QMetaObject::invokeMethod(m_encoder.data(), "stop", Qt::BlockingQueuedConnection);
 }
 
 void ScreenRecorder::tick()
 {
-    m_frames += 1;
-    if (m_frames % 60 == 0) {
-        qDebug() << "tick";
-        m_indicator->updateElapsed(QTime::fromMSecsSinceStartOfDay(m_elapsed.elapsed()));
-    }
+    const auto stats = m_pacer->stats();
+    qDebug() << "tick," << stats.frames << "frames" << stats.missed << "missed, jitter"
+             << stats.meanJitter << "us";
+    m_indicator->updateElapsed(QTime::fromMSecsSinceStartOfDay(m_clock->now() / 1000));
+}
+
+void ScreenRecorder::storageCongested(bool congested)
+{
+    // Halve the capture rate until the storage caught up again, rather
+    // than letting the encoder queue drop frames at random.
+    qWarning() << "storage" << (congested ? "congested" : "caught up");
+    const double framerate = congested ? m_framerate / 2.0 : m_framerate;
+    QMetaObject::invokeMethod(m_pacer.data(), "setFramerate", Qt::QueuedConnection,
+                              Q_ARG(double, framerate));
 }
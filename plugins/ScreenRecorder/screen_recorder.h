@@ -19,30 +19,31 @@
 #define SCREEN_RECORDER_H
 
 #include "captures/capture.h"
+#include "captures/microphone.h"
 #include "encoders/encoder.h"
 #include "muxers/mux.h"
+#include "framepacer.h"
 #include "indicator.h"
-#include "aacconverter.h"
+#include "mediaclock.h"
 #include <QObject>
 #include <QThread>
 #include <QSharedPointer>
 #include <QTimer>
-#include <QElapsedTimer>
-#include <QAudioInput>
-#include <QIODevice>
 
 class ScreenRecorder : public QObject
 {
     Q_OBJECT
 public:
     ScreenRecorder(QObject *parent = nullptr);
+    // The microphone is optional, its buffers go to the mux as audio
     void setup(QSharedPointer<QObject> encoder, QSharedPointer<QObject> capture,
-               QSharedPointer<QObject> mux);
+               QSharedPointer<QObject> mux, QSharedPointer<MicrophoneCapture> microphone = {});
 public Q_SLOTS:
-    void start(float framerate, bool mic);
+    void start(float framerate);
     void stop();
     void bufferAvailable();
     void tick();
+    void storageCongested(bool congested);
 
 private:
     QThread m_captureThread;
@@ -53,14 +54,15 @@ private:
     QSharedPointer<QObject> m_encoder;
     QSharedPointer<QObject> m_capture;
     QSharedPointer<QObject> m_mux;
-    QSharedPointer<QAudioInput> m_audioInput;
-    QSharedPointer<QIODevice> m_microphoneAudio;
-    AacConverter m_aacConverter;
+    QSharedPointer<MicrophoneCapture> m_microphone;
+    // Lives on the capture thread and triggers the capture from there
+    QSharedPointer<FramePacer> m_pacer;
+    // Updates the indicator
     QTimer m_timer;
     QSharedPointer<Indicator> m_indicator;
-    QElapsedTimer m_elapsed;
-    uint64_t m_frames;
-    bool m_mic;
+    // Every buffer of the recording is stamped against it
+    MediaClock::Ptr m_clock;
+    float m_framerate = 60.0f;
 };
 
 #endif // SCREEN_RECORDER_H
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "non_copyable.h"
+
+// Fixed capacity map from a pointer to a value, for tracking objects that
+// are handed to another component and come back later. It never allocates
+// after construction; lookups use open addressing with linear probing and
+// removal shifts the following entries back, so there are no tombstones.
+//
+// At most maxEntries values can be stored at once. insert() blocks while
+// the map is full, which bounds the number of objects in flight. All
+// methods may be called from any thread.
+template <typename Key, typename Value>
+class SlotMap : public NonCopyable
+{
+public:
+    explicit SlotMap(uint32_t maxEntries)
+        : m_maxEntries(maxEntries), m_mask(tableSizeFor(maxEntries) - 1),
+          m_slots(new Slot[m_mask + 1])
+    {
+    }
+
+    // Returns false if no entry became free within the timeout or the key
+    // is already present.
+    bool insert(Key key, const Value &value,
+                const std::chrono::milliseconds &timeout = std::chrono::milliseconds{ 1500 })
+    {
+        std::unique_lock<std::mutex> l(m_mutex);
+        if (!m_available.wait_for(l, timeout, [&]() { return m_count < m_maxEntries; }))
+            return false;
+
+        auto index = indexFor(key);
+        while (m_slots[index].key) {
+            if (m_slots[index].key == key)
+                return false;
+            index = (index + 1) & m_mask;
+        }
+
+        m_slots[index].key = key;
+        m_slots[index].value = value;
+        m_count++;
+        return true;
+    }
+
+    // Moves the value stored for key into value and frees its entry.
+    bool take(Key key, Value &value)
+    {
+        {
+            std::lock_guard<std::mutex> l(m_mutex);
+
+            auto index = indexFor(key);
+            while (m_slots[index].key != key) {
+                if (!m_slots[index].key)
+                    return false;
+                index = (index + 1) & m_mask;
+            }
+
+            value = std::move(m_slots[index].value);
+            m_slots[index] = Slot();
+            m_count--;
+
+            // Pull following entries of the probe sequence into the hole
+            // so lookups can stop at the first empty slot.
+            auto hole = index;
+            for (auto next = (hole + 1) & m_mask; m_slots[next].key; next = (next + 1) & m_mask) {
+                const auto home = indexFor(m_slots[next].key);
+                if (((next - home) & m_mask) >= ((next - hole) & m_mask)) {
+                    m_slots[hole] = std::move(m_slots[next]);
+                    m_slots[next] = Slot();
+                    hole = next;
+                }
+            }
+        }
+
+        m_available.notify_one();
+        return true;
+    }
+
+    uint32_t size() const
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        return m_count;
+    }
+
+    uint32_t maxEntries() const { return m_maxEntries; }
+
+private:
+    struct Slot
+    {
+        Key key = nullptr;
+        Value value = Value();
+    };
+
+    // Keep the load factor at or below one half
+    static uint32_t tableSizeFor(uint32_t maxEntries)
+    {
+        uint32_t size = 2;
+        while (size < maxEntries * 2)
+            size <<= 1;
+        return size;
+    }
+
+    uint32_t indexFor(Key key) const
+    {
+        // Pointers are aligned, mix the high bits down before masking
+        auto hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+        hash *= 0x9e3779b97f4a7c15ull;
+        return static_cast<uint32_t>(hash >> 32) & m_mask;
+    }
+
+    const uint32_t m_maxEntries;
+    const uint32_t m_mask;
+    std::unique_ptr<Slot[]> m_slots;
+    uint32_t m_count = 0;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_available;
+};
+
+#endif // SLOT_MAP_H
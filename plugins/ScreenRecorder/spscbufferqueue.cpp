@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "spscbufferqueue.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+
+namespace {
+static constexpr std::chrono::microseconds kPollInterval{ 500 };
+
+uint32_t roundUpToPowerOfTwo(uint32_t value)
+{
+    if (value < 2)
+        return 2;
+
+    value--;
+    value |= value >> 1;
+    value |= value >> 2;
+    value |= value >> 4;
+    value |= value >> 8;
+    value |= value >> 16;
+    return value + 1;
+}
+} // namespace
+
+SpscBufferQueue::SpscBufferQueue(uint32_t capacity, OverflowPolicy policy, Wakeup wakeup,
+                                 const std::chrono::milliseconds &pushTimeout)
+    : m_capacity(roundUpToPowerOfTwo(capacity)),
+      m_mask(m_capacity - 1),
+      m_policy(policy),
+      m_wakeup(wakeup),
+      m_pushTimeout(pushTimeout),
+      m_slots(new Slot[m_capacity])
+{
+    for (uint32_t i = 0; i < m_capacity; i++)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    if (m_wakeup == Wakeup::EventFd) {
+        m_eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventFd < 0)
+            qWarning() << "failed to create eventfd, falling back to polling";
+    }
+}
+
+SpscBufferQueue::~SpscBufferQueue()
+{
+    if (m_eventFd >= 0)
+        ::close(m_eventFd);
+}
+
+bool SpscBufferQueue::isFree(const Slot &slot, uint32_t head) const
+{
+    return slot.sequence.load(std::memory_order_acquire) == head;
+}
+
+void SpscBufferQueue::drop(const Buffer::Ptr &buffer)
+{
+    m_drops.fetch_add(1, std::memory_order_relaxed);
+    if (buffer)
+        buffer->Release();
+}
+
+bool SpscBufferQueue::waitForSlot(const Slot &slot, uint32_t head)
+{
+    if (isFree(slot, head))
+        return true;
+    if (m_policy == OverflowPolicy::DropNewest)
+        return false;
+
+    // With the evicting policies the consumer has just claimed the oldest
+    // buffer and is moving it out of the slot, that's only a moment.
+    const auto waitStart = std::chrono::steady_clock::now();
+    const auto deadline = waitStart + m_pushTimeout;
+    bool free = false;
+    while (!(free = isFree(slot, head)) && std::chrono::steady_clock::now() < deadline) {
+        if (m_policy == OverflowPolicy::Block)
+            std::this_thread::sleep_for(kPollInterval);
+        else
+            std::this_thread::yield();
+    }
+    m_pushWaitUs.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - waitStart)
+                                   .count(),
+                           std::memory_order_relaxed);
+    return free;
+}
+
+bool SpscBufferQueue::push(const Buffer::Ptr &buffer)
+{
+    const auto head = m_head.load(std::memory_order_relaxed);
+    auto &slot = m_slots[head & m_mask];
+
+    if (m_policy == OverflowPolicy::CoalesceLatest) {
+        while (auto stale = pop())
+            drop(stale);
+    } else if (m_policy == OverflowPolicy::DropOldest && !isFree(slot, head)) {
+        // The oldest buffer occupies the slot we need. If the consumer
+        // beats us to it there's nothing to drop.
+        if (auto stale = pop())
+            drop(stale);
+    }
+
+    if (!waitForSlot(slot, head)) {
+        drop(buffer);
+        return false;
+    }
+
+    slot.buffer = buffer;
+    slot.sequence.store(head + 1, std::memory_order_release);
+    m_head.store(head + 1, std::memory_order_release);
+
+    m_pushes.fetch_add(1, std::memory_order_relaxed);
+    const auto depth = head + 1 - m_tail.load(std::memory_order_relaxed);
+    if (depth > m_highWaterMark.load(std::memory_order_relaxed))
+        m_highWaterMark.store(depth, std::memory_order_relaxed);
+
+    notify();
+    return true;
+}
+
+Buffer::Ptr SpscBufferQueue::pop()
+{
+    auto tail = m_tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        auto &slot = m_slots[tail & m_mask];
+        const auto sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto filled = static_cast<int32_t>(sequence - (tail + 1));
+
+        if (filled < 0)
+            return nullptr;
+
+        if (filled > 0) {
+            // The other side took this one, our tail is stale
+            tail = m_tail.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+            auto buffer = std::move(slot.buffer);
+            slot.buffer.reset();
+            slot.sequence.store(tail + m_capacity, std::memory_order_release);
+            return buffer;
+        }
+    }
+}
+
+Buffer::Ptr SpscBufferQueue::next(const std::chrono::milliseconds &timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    for (;;) {
+        if (auto buffer = pop())
+            return buffer;
+
+        const auto waitStart = std::chrono::steady_clock::now();
+        if (waitStart >= deadline)
+            return nullptr;
+
+        wait(deadline);
+        m_popWaitUs.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - waitStart)
+                                      .count(),
+                              std::memory_order_relaxed);
+    }
+}
+
+void SpscBufferQueue::wakeConsumer()
+{
+    if (m_eventFd < 0)
+        return;
+
+    const uint64_t value = 1;
+    if (::write(m_eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        qWarning() << "failed to signal queue consumer";
+}
+
+void SpscBufferQueue::notify()
+{
+    if (m_eventFd < 0)
+        return;
+
+    // Pairs with the fence in wait(): either the consumer sees the new head
+    // or we see that it went to sleep and have to wake it up.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiting.load(std::memory_order_relaxed))
+        wakeConsumer();
+}
+
+void SpscBufferQueue::wait(const std::chrono::steady_clock::time_point &deadline)
+{
+    if (m_eventFd < 0) {
+        std::this_thread::sleep_for(kPollInterval);
+        return;
+    }
+
+    m_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_relaxed)) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+
+        struct pollfd fds = { m_eventFd, POLLIN, 0 };
+        ::poll(&fds, 1, std::max<int>(remaining.count(), 1));
+    }
+
+    m_waiting.store(false, std::memory_order_relaxed);
+
+    // Reset the counter, any wakeup we missed here is covered by the
+    // consumer checking the ring again before sleeping.
+    uint64_t value = 0;
+    while (::read(m_eventFd, &value, sizeof(value)) > 0) { }
+}
+
+bool SpscBufferQueue::isFull() const
+{
+    return size() >= static_cast<int>(m_capacity);
+}
+
+bool SpscBufferQueue::isEmpty() const
+{
+    return size() == 0;
+}
+
+int SpscBufferQueue::size() const
+{
+    const auto tail = m_tail.load(std::memory_order_acquire);
+    const auto head = m_head.load(std::memory_order_acquire);
+    return static_cast<int>(head - tail);
+}
+
+SpscBufferQueue::Stats SpscBufferQueue::stats() const
+{
+    Stats stats;
+    stats.pushes = m_pushes.load(std::memory_order_relaxed);
+    stats.drops = m_drops.load(std::memory_order_relaxed);
+    stats.highWaterMark = m_highWaterMark.load(std::memory_order_relaxed);
+    stats.pushWait = std::chrono::microseconds(m_pushWaitUs.load(std::memory_order_relaxed));
+    stats.popWait = std::chrono::microseconds(m_popWaitUs.load(std::memory_order_relaxed));
+    return stats;
+}
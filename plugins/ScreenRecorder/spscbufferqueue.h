@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2023 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPSC_BUFFER_QUEUE_H
+#define SPSC_BUFFER_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "buffer.h"
+#include "bufferqueue.h"
+#include "non_copyable.h"
+
+// Bounded single-producer/single-consumer ring of buffers. It never takes
+// a lock: exactly one thread may push and exactly one other thread may pop.
+// Like BufferQueue it hands every buffer it drops back through
+// Buffer::Release(), push() additionally tells whether the buffer was
+// queued.
+//
+// Every slot carries a sequence number telling whether it is free or
+// filled, so the producer can take the oldest buffer out itself: with
+// DropOldest and CoalesceLatest it claims it with a CAS on the tail,
+// competing with the consumer, and the ring never holds more than its
+// capacity.
+class SpscBufferQueue : public NonCopyable
+{
+public:
+    typedef BufferQueue::OverflowPolicy OverflowPolicy;
+    typedef BufferQueue::Stats Stats;
+
+    enum class Wakeup {
+        // Sleep on an eventfd while empty, producer signals only when the
+        // consumer actually waits.
+        EventFd,
+        // Poll with short sleeps, avoids syscalls on the producer side.
+        Poll,
+    };
+
+    // The capacity is rounded up to the next power of two.
+    explicit SpscBufferQueue(uint32_t capacity = 16,
+                             OverflowPolicy policy = OverflowPolicy::DropNewest,
+                             Wakeup wakeup = Wakeup::EventFd,
+                             const std::chrono::milliseconds &pushTimeout = std::chrono::milliseconds{ 100 });
+    ~SpscBufferQueue();
+
+    // Producer side. Returns false if the ring is full and the buffer was
+    // dropped, in which case it has already been released.
+    bool push(const Buffer::Ptr &buffer);
+
+    // Consumer side. next() waits up to the given timeout for a buffer,
+    // pop() returns nullptr right away if nothing is queued.
+    Buffer::Ptr next(const std::chrono::milliseconds &timeout = std::chrono::milliseconds{ 1500 });
+    Buffer::Ptr pop();
+
+    bool isFull() const;
+    bool isEmpty() const;
+    int size() const;
+    uint32_t capacity() const { return m_capacity; }
+    OverflowPolicy overflowPolicy() const { return m_policy; }
+
+    // May be called from any thread
+    Stats stats() const;
+
+private:
+    static constexpr std::size_t kCacheLineSize = 64;
+
+    struct Slot
+    {
+        // Index of the push which may fill it when free, that index + 1
+        // once filled
+        std::atomic<uint32_t> sequence{ 0 };
+        Buffer::Ptr buffer;
+    };
+
+    bool isFree(const Slot &slot, uint32_t head) const;
+    void drop(const Buffer::Ptr &buffer);
+    bool waitForSlot(const Slot &slot, uint32_t head);
+    void notify();
+    void wakeConsumer();
+    void wait(const std::chrono::steady_clock::time_point &deadline);
+
+    const uint32_t m_capacity;
+    const uint32_t m_mask;
+    const OverflowPolicy m_policy;
+    const Wakeup m_wakeup;
+    const std::chrono::milliseconds m_pushTimeout;
+    std::unique_ptr<Slot[]> m_slots;
+    int m_eventFd = -1;
+
+    // Producer owned
+    alignas(kCacheLineSize) std::atomic<uint32_t> m_head{ 0 };
+    std::atomic<uint64_t> m_pushes{ 0 };
+    std::atomic<uint32_t> m_highWaterMark{ 0 };
+    std::atomic<int64_t> m_pushWaitUs{ 0 };
+
+    // Advanced by the consumer, and by the producer when it evicts
+    alignas(kCacheLineSize) std::atomic<uint32_t> m_tail{ 0 };
+    std::atomic<int64_t> m_popWaitUs{ 0 };
+
+    alignas(kCacheLineSize) std::atomic<bool> m_waiting{ false };
+    std::atomic<uint64_t> m_drops{ 0 };
+};
+
+#endif // SPSC_BUFFER_QUEUE_H
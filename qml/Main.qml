@@ -485,12 +485,14 @@ MainView {
                     color: theme.palette.normal.negative
                     text: i18n.tr("Delete")
                     onClicked: {
+                        Controller.cancelEditing()
                         cutPage.hide()
                     }
                 }
                 Button {
                     color: theme.palette.normal.positive
                     text: i18n.tr("Save")
+                    enabled: !Controller.editing
                     onClicked: {
                         if (videoRange.first.value > 0 ||
                                 videoRange.second.value < video.duration - 500) {
@@ -521,6 +523,14 @@ MainView {
                 running: Controller.editing
                 visible: running
             }
+
+            QQC.ProgressBar {
+                Layout.alignment: Qt.AlignHCenter | Qt.AlignVCenter
+                from: 0
+                to: 100
+                value: Controller.editProgress
+                visible: Controller.editing
+            }
         }
     }
 